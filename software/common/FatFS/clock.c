@@ -19,14 +19,17 @@ DWORD get_fattime (void){
 	 * bit10:5  Minute (0..59)
 	 * bit4:0   Second / 2 (0..29, e.g. 25 for 50)
 	 */
-	DWORD timestamp = GLOBAL_frame_gps_current.time.seconds/2;
-	timestamp |= GLOBAL_frame_gps_current.time.minutes << 5;
-	timestamp |= GLOBAL_frame_gps_current.time.hours << 11;
-	timestamp |= GLOBAL_frame_gps_current.date.day << 16;
-	timestamp |= GLOBAL_frame_gps_current.date.month << 21;
+	frame_gps_t gps;
+	gps_core_get_current(&gps);
+
+	DWORD timestamp = gps.time.seconds/2;
+	timestamp |= gps.time.minutes << 5;
+	timestamp |= gps.time.hours << 11;
+	timestamp |= gps.date.day << 16;
+	timestamp |= gps.date.month << 21;
 
 	//GPS year is just two digits, eg. 2017 = 17
-	timestamp |= (GLOBAL_frame_gps_current.date.year+20) << 25;
+	timestamp |= (gps.date.year+20) << 25;
 
 	return timestamp;
 }
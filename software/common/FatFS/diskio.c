@@ -10,6 +10,11 @@
 #include <debug.h>
 #include "diskio.h"		/* FatFs lower layer API */
 #include "mmc.h"
+#include <string.h>
+
+#if BOOTLOADER_BUILD != 1 //the bootloader doesn't report statistics
+static disk_stats_t _stats;
+#endif
 
 //#define DEBUG_TERMINAL 0
 
@@ -57,6 +62,10 @@ DRESULT disk_read_INTERNAL (
 {
 	//debugf("Call from %ld", line_number);
 	DRESULT r = mmc_disk_read(buff, sector, count);
+#if BOOTLOADER_BUILD != 1
+	_stats.read_commands++;
+	_stats.sectors_read += count;
+#endif
 	debugf("call from %ld buf=%p sector=%ld count=%ld", line_number, buff, sector, count);
 	return r;
 }
@@ -76,6 +85,10 @@ DRESULT disk_write (
 )
 {
 	DRESULT r = mmc_disk_write(buff, sector, count);
+#if BOOTLOADER_BUILD != 1
+	_stats.write_commands++;
+	_stats.sectors_written += count;
+#endif
 	debugf("buf=%p sector=%ld count=%ld", buff, sector, count);
 	return r;
 }
@@ -86,6 +99,14 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
+#if BOOTLOADER_BUILD != 1
+void disk_get_stats(disk_stats_t *stats){
+	memcpy(stats, &_stats, sizeof(_stats));
+}
+#endif
+
+
+
 #if _USE_IOCTL
 DRESULT disk_ioctl (
 		BYTE pdrv __attribute__((unused)),		/* Physical drive nmuber (0..) */
@@ -54,6 +54,16 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #endif
 
+/* Card traffic since boot, for write amplification statistics */
+typedef struct {
+	uint32_t read_commands;
+	uint32_t sectors_read;
+	uint32_t write_commands;
+	uint32_t sectors_written;
+} disk_stats_t;
+
+void disk_get_stats(disk_stats_t *stats);
+
 
 /* Disk Status Bits (DSTATUS) */
 #define STA_NOINIT		0x01	/* Drive not initialized */
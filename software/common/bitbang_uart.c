@@ -28,10 +28,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  * hardware uart, but the RX line (which should be TX) can not, so reception from the
  * GPS is handled by the hardware UART, but transmission to the GPS (to lower the refresh
  * rate and switch it to low-power state) is done by this module.
+ * PCB v0.2 transmits with the hardware UART (see GPS_TX_BITBANG in pins.h).
  */
 
 #define BITBANG_BAUD 9600
 
+static uint32_t _baud = BITBANG_BAUD;
+
 typedef enum {
 	uart_tx_state_start_bit,
 	uart_tx_state_bit_0,
@@ -73,7 +76,11 @@ void bitbang_uart_transmit(uint32_t length, const uint8_t *data, bitbang_uart_tx
 	_fsm = uart_tx_state_start_bit;
 	_tx_complete_callback = cb;
 	__DMB(); //ensure all data is in the memory before enabling interrupts
-	timer_periodic_isr_enable(DEFAULT_BUS_CLOCK/*Hz*/ / BITBANG_BAUD);
+	timer_periodic_isr_enable(DEFAULT_BUS_CLOCK/*Hz*/ / _baud);
+}
+
+void bitbang_uart_set_baud(uint32_t baud){
+	_baud = baud; //the timer period is set when a transmission starts
 }
 
 extern void TIMER_PERIODIC_IRQ_HANDLER(void);
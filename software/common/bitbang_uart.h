@@ -8,3 +8,6 @@ void bitbang_uart_deinit(void);
 
 //data must be statically allocated, callback is delivered from ISR
 void bitbang_uart_transmit(uint32_t length, const uint8_t *data, bitbang_uart_tx_complete_callback cb);
+
+//doesn't block, applies to the next transmission (a transmission in progress keeps its rate)
+void bitbang_uart_set_baud(uint32_t baud);
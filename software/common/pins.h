@@ -1,6 +1,13 @@
 #pragma once
 #include <MKE06Z4.h>
 
+#ifndef PCB_REVISION
+#define PCB_REVISION 1 //PCB v0.1, build with -DPCB_REVISION=2 for PCB v0.2
+#endif
+
+//PCB v0.1 has crossed GPS UART lines, transmission to the GPS is bit-banged (see bitbang_uart.c)
+#define GPS_TX_BITBANG (PCB_REVISION < 2)
+
 #ifdef BOARD_EVK
 
 #define LED_INIT() do {\
@@ -0,0 +1,213 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <elf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Formats a binary debug file (obdlog/debug/logNNNNN.bin) written by the firmware.
+ * The format strings are not in the file, they are read from the firmware ELF file
+ * at the addresses stored in the records - it must be the ELF of the firmware that
+ * wrote the debug file. See obdlogger/Sources/debug.c for the record format.
+ *
+ * Usage: debug_decoder firmware.elf log00012.bin > log00012.txt
+ */
+
+#define RECORD_SYNC 0xDB
+#define RECORD_FLASH_STRING 0xFF
+#define MAX_SECTIONS 64
+
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	const uint8_t *data;
+} section_t;
+
+static section_t _sections[MAX_SECTIONS];
+static uint32_t _section_count;
+
+static uint8_t *read_file(const char *path, long *size);
+static bool load_elf(const uint8_t *elf, long size);
+static const char *string_at(uint32_t address);
+static uint32_t get_u32(const uint8_t *buffer);
+static bool print_record(const uint8_t *record, uint32_t length);
+
+int main(int argc, char *argv[]){
+	if (argc != 3){
+		fprintf(stderr, "Usage: %s firmware.elf debug.bin\n", argv[0]);
+		return 1;
+	}
+
+	long elf_size, log_size;
+	uint8_t *elf = read_file(argv[1], &elf_size);
+	uint8_t *log = read_file(argv[2], &log_size);
+	if (elf == NULL || log == NULL || load_elf(elf, elf_size) == false){
+		return 1;
+	}
+
+	uint32_t skipped = 0;
+	long i = 0;
+	while (i + 2 <= log_size){
+		uint32_t length = log[i + 1];
+		if (log[i] == RECORD_SYNC && i + 2 + length <= log_size && print_record(log + i + 2, length)){
+			i += 2 + length;
+		} else {
+			skipped++; //damaged record, look for the next sync byte
+			i++;
+		}
+	}
+	if (skipped){
+		fprintf(stderr, "%u bytes skipped\n", skipped);
+	}
+	return 0;
+}
+
+static uint8_t *read_file(const char *path, long *size){
+	FILE *f = fopen(path, "rb");
+	if (f == NULL){
+		perror(path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *data = malloc(*size + 1);
+	if (data == NULL || fread(data, 1, *size, f) != (size_t)*size){
+		fprintf(stderr, "Can't read %s\n", path);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	return data;
+}
+
+static bool load_elf(const uint8_t *elf, long size){
+	const Elf32_Ehdr *header = (const Elf32_Ehdr*)elf;
+	if (size < (long)sizeof(*header) || memcmp(header->e_ident, ELFMAG, SELFMAG) ||
+			header->e_ident[EI_CLASS] != ELFCLASS32 ||
+			header->e_shoff + (long)header->e_shnum * sizeof(Elf32_Shdr) > (unsigned long)size){
+		fprintf(stderr, "Not a 32-bit ELF file\n");
+		return false;
+	}
+
+	//sections loaded into the target memory hold the format strings
+	const Elf32_Shdr *sections = (const Elf32_Shdr*)(elf + header->e_shoff);
+	for (uint32_t i = 0; i < header->e_shnum && _section_count < MAX_SECTIONS; i++){
+		const Elf32_Shdr *s = &sections[i];
+		if (s->sh_type == SHT_PROGBITS && (s->sh_flags & SHF_ALLOC) && s->sh_offset + s->sh_size <= (unsigned long)size){
+			_sections[_section_count].address = s->sh_addr;
+			_sections[_section_count].size = s->sh_size;
+			_sections[_section_count].data = elf + s->sh_offset;
+			_section_count++;
+		}
+	}
+	return true;
+}
+
+static const char *string_at(uint32_t address){
+	for (uint32_t i = 0; i < _section_count; i++){
+		const section_t *s = &_sections[i];
+		if (address >= s->address && address < s->address + s->size &&
+				memchr(s->data + (address - s->address), '\0', s->size - (address - s->address))){
+			return (const char*)s->data + (address - s->address);
+		}
+	}
+	return NULL;
+}
+
+static uint32_t get_u32(const uint8_t *buffer){
+	return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (uint32_t)buffer[3] << 24;
+}
+
+static bool print_record(const uint8_t *record, uint32_t length){
+	if (length < 8){
+		return false;
+	}
+	const char *format = string_at(get_u32(record + 4));
+	if (format == NULL){
+		return false;
+	}
+	printf("%u", get_u32(record));
+
+	//every conversion is printed on its own, 32-bit target values become host int or string
+	uint32_t n = 8;
+	for (const char *p = format; *p; p++){
+		if (*p != '%'){
+			putchar(*p);
+			continue;
+		}
+		char spec[16];
+		uint32_t spec_length = 0;
+		spec[spec_length++] = '%';
+		p++;
+		while (*p && strchr("-+ #0123456789.lhz", *p)){
+			if (strchr("lhz", *p) == NULL && spec_length < sizeof(spec) - 2){
+				spec[spec_length++] = *p; //length modifiers are dropped
+			}
+			p++;
+		}
+		if (*p == '\0'){
+			break;
+		} else if (*p == '%'){
+			putchar('%');
+			continue;
+		}
+		spec[spec_length++] = *p;
+		spec[spec_length] = '\0';
+
+		if (*p == 's'){
+			if (n + 1 > length){
+				printf("<missing>");
+				continue;
+			}
+			if (record[n] == RECORD_FLASH_STRING && n + 5 <= length){
+				const char *s = string_at(get_u32(record + n + 1));
+				printf(spec, s ? s : "<unknown string>");
+				n += 5;
+			} else {
+				uint32_t string_length = record[n];
+				n++;
+				if (n + string_length > length){
+					string_length = length - n;
+				}
+				char s[256];
+				memcpy(s, record + n, string_length);
+				s[string_length] = '\0';
+				printf(spec, s);
+				n += string_length;
+			}
+		} else {
+			if (n + 4 > length){
+				printf("<missing>");
+				continue;
+			}
+			uint32_t value = get_u32(record + n);
+			n += 4;
+			if (*p == 'd' || *p == 'i'){
+				printf(spec, (int)value);
+			} else if (*p == 'p'){
+				printf("0x%08x", value);
+			} else {
+				printf(spec, (unsigned int)value);
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,10 @@
+BUILD_DIR  := build/targets
+
+TARGET_DIR := build
+
+SOURCES := \
+    main.c
+
+TGT_CFLAGS := -std=gnu11 -O2 -Wall
+
+TARGET :=debug_decoder
@@ -0,0 +1,255 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "minmea.h"
+#include "nmea_parser.h"
+#undef timespec //minmea.h maps it to struct tm for the firmware
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER 1
+#endif
+/* Host micro-benchmark of the firmware NMEA parser against minmea.
+ *
+ * Every sentence is parsed ITERATIONS times by:
+ *  - minmea_sentence_id() + minmea_parse_rmc/gga/vtg() on a complete line
+ *  - the same plus rescaling of the minmea_float_t values to the units
+ *    nmea_parser produces (1e-7 degrees, mm/s, centidegrees), which is the
+ *    work every consumer had to do
+ *  - nmea_parser_consume() fed byte by byte, as the firmware does
+ * and the results of both parsers are compared.
+ *
+ * Host numbers only show the relative cost, on the Cortex-M0+ the gap is
+ * larger because every division is a library call there.
+ */
+
+#define ITERATIONS 200000
+
+static const char *SENTENCE_BODIES[] = {
+		"GPRMC,064951.000,A,2307.1256,N,12016.4438,E,0.03,165.48,260406,3.05,W,A",
+		"GPGGA,064951.000,2307.1256,N,12016.4438,E,1,8,0.95,39.9,M,17.8,M,,",
+		"GPVTG,165.48,T,,M,0.03,N,0.06,K,A",
+		"GPRMC,123519.200,A,4807.0381,S,01131.0002,W,022.4,084.4,230394,003.1,W,A",
+		"GPVTG,054.7,T,034.4,M,005.5,N,010.2,K,A",
+};
+#define SENTENCE_COUNT (sizeof(SENTENCE_BODIES) / sizeof(SENTENCE_BODIES[0]))
+
+static char _lines[SENTENCE_COUNT][MINMEA_MAX_LENGTH + 8];
+static volatile int32_t _sink; //keeps the compiler from dropping the work
+
+typedef struct {
+	int32_t latitude_e7;
+	int32_t longitude_e7;
+	uint32_t speed_mm_s;
+	uint16_t course_centidegrees;
+} fixed_values_t;
+
+typedef struct {
+	uint64_t ns;
+	uint64_t cycles;
+} duration_t;
+
+static void build_line(char *line, const char *body);
+static bool parse_minmea(const char *line, bool rescale, fixed_values_t *values);
+static bool parse_nmea_parser(nmea_parser_t *parser, const char *line, fixed_values_t *values);
+static int32_t coordinate_e7(const minmea_float_t *f);
+static duration_t measure(uint32_t index, int method);
+static uint64_t now_ns(void);
+static uint64_t now_cycles(void);
+
+int main(void){
+	for (uint32_t i = 0; i < SENTENCE_COUNT; i++){
+		build_line(_lines[i], SENTENCE_BODIES[i]);
+	}
+
+#ifdef HAVE_CYCLE_COUNTER
+	printf("TSC cycles per sentence\n");
+#else
+	printf("ns per sentence\n");
+#endif
+	printf("%-6s %12s %12s %12s\n", "", "minmea", "minmea+scale", "nmea_parser");
+	duration_t total[3] = { { 0 } };
+	for (uint32_t i = 0; i < SENTENCE_COUNT; i++){
+		printf("%-6.5s", _lines[i] + 1);
+		for (int method = 0; method < 3; method++){
+			duration_t d = measure(i, method);
+			total[method].ns += d.ns;
+			total[method].cycles += d.cycles;
+#ifdef HAVE_CYCLE_COUNTER
+			printf(" %12.1f", (double)d.cycles / ITERATIONS);
+#else
+			printf(" %12.1f", (double)d.ns / ITERATIONS);
+#endif
+		}
+		printf("\n");
+	}
+	printf("%-6s", "mean");
+	for (int method = 0; method < 3; method++){
+#ifdef HAVE_CYCLE_COUNTER
+		printf(" %12.1f", (double)total[method].cycles / ITERATIONS / SENTENCE_COUNT);
+#else
+		printf(" %12.1f", (double)total[method].ns / ITERATIONS / SENTENCE_COUNT);
+#endif
+	}
+	printf("\n");
+
+	//both parsers must agree, the fixed-point conversion may differ in the last unit
+	int errors = 0;
+	for (uint32_t i = 0; i < SENTENCE_COUNT; i++){
+		nmea_parser_t parser = { 0 };
+		fixed_values_t reference = { 0 }, values = { 0 };
+		if (parse_minmea(_lines[i], true, &reference) == false || parse_nmea_parser(&parser, _lines[i], &values) == false){
+			printf("%s: not parsed\n", _lines[i]);
+			errors++;
+			continue;
+		}
+		int32_t d_lat = values.latitude_e7 - reference.latitude_e7;
+		int32_t d_lon = values.longitude_e7 - reference.longitude_e7;
+		int32_t d_speed = values.speed_mm_s - reference.speed_mm_s;
+		int32_t d_course = values.course_centidegrees - reference.course_centidegrees;
+		if (d_lat < -1 || d_lat > 1 || d_lon < -1 || d_lon > 1 || d_speed < -1 || d_speed > 1 || d_course != 0){
+			printf("%.5s: mismatch lat %d/%d lon %d/%d speed %u/%u course %u/%u\n", _lines[i] + 1,
+					values.latitude_e7, reference.latitude_e7, values.longitude_e7, reference.longitude_e7,
+					values.speed_mm_s, reference.speed_mm_s, values.course_centidegrees, reference.course_centidegrees);
+			errors++;
+		}
+	}
+	printf("%s\n", errors ? "RESULTS DIFFER" : "results match");
+	return errors ? 1 : 0;
+}
+
+static void build_line(char *line, const char *body){
+	uint8_t checksum = 0;
+	for (const char *c = body; *c; c++){
+		checksum ^= *c;
+	}
+	sprintf(line, "$%s*%02X\r\n", body, checksum);
+}
+
+static duration_t measure(uint32_t index, int method){
+	const char *line = _lines[index];
+	nmea_parser_t parser = { 0 };
+	fixed_values_t values;
+
+	uint64_t start_ns = now_ns();
+	uint64_t start_cycles = now_cycles();
+	for (uint32_t i = 0; i < ITERATIONS; i++){
+		if (method == 2){
+			parse_nmea_parser(&parser, line, &values);
+		} else {
+			parse_minmea(line, method == 1, &values);
+		}
+		_sink = values.latitude_e7 + values.speed_mm_s;
+	}
+	duration_t d = { now_ns() - start_ns, now_cycles() - start_cycles };
+	return d;
+}
+
+static bool parse_minmea(const char *line, bool rescale, fixed_values_t *values){
+	switch (minmea_sentence_id(line, false)){
+	case MINMEA_SENTENCE_RMC: {
+		struct minmea_sentence_rmc frame;
+		if (minmea_parse_rmc(&frame, line) == false){
+			return false;
+		}
+		if (rescale){
+			values->latitude_e7 = coordinate_e7(&frame.latitude);
+			values->longitude_e7 = coordinate_e7(&frame.longitude);
+			values->speed_mm_s = frame.speed.scale ? (int64_t)frame.speed.value * 1852000 / 3600 / frame.speed.scale : 0;
+			values->course_centidegrees = frame.course.scale ? (int64_t)frame.course.value * 100 / frame.course.scale : 0;
+		} else {
+			values->latitude_e7 = frame.latitude.value;
+			values->speed_mm_s = frame.speed.value;
+		}
+		return true;
+	}
+	case MINMEA_SENTENCE_GGA: {
+		struct minmea_sentence_gga frame;
+		if (minmea_parse_gga(&frame, line) == false){
+			return false;
+		}
+		//nmea_parser keeps only time from GGA
+		values->latitude_e7 = rescale ? 0 : frame.latitude.value;
+		values->longitude_e7 = 0;
+		values->speed_mm_s = 0;
+		values->course_centidegrees = 0;
+		return true;
+	}
+	case MINMEA_SENTENCE_VTG: {
+		struct minmea_sentence_vtg frame;
+		if (minmea_parse_vtg(&frame, line) == false){
+			return false;
+		}
+		values->latitude_e7 = 0;
+		values->longitude_e7 = 0;
+		if (rescale){
+			values->speed_mm_s = frame.speed_kph.scale ? (int64_t)frame.speed_kph.value * 1000000 / 3600 / frame.speed_kph.scale : 0;
+			values->course_centidegrees = frame.true_track_degrees.scale ?
+					(int64_t)frame.true_track_degrees.value * 100 / frame.true_track_degrees.scale : 0;
+		} else {
+			values->speed_mm_s = frame.speed_kph.value;
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+static bool parse_nmea_parser(nmea_parser_t *parser, const char *line, fixed_values_t *values){
+	for (const char *c = line; *c; c++){
+		if (nmea_parser_consume(parser, *c)){
+			const nmea_sentence_t *sentence = &parser->sentence;
+			bool vtg = sentence->id == nmea_sentence_vtg;
+			values->latitude_e7 = vtg ? 0 : sentence->latitude_e7;
+			values->longitude_e7 = vtg ? 0 : sentence->longitude_e7;
+			values->speed_mm_s = sentence->speed_mm_s;
+			values->course_centidegrees = sentence->course_centidegrees;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int32_t coordinate_e7(const minmea_float_t *f){
+	//NMEA DDDMM.MMMM to 1e-7 degrees, the way the firmware used to do it
+	if (f->scale == 0){
+		return 0;
+	}
+	int64_t value = f->value < 0 ? -(int64_t)f->value : f->value;
+	int64_t degrees = value / (f->scale * 100);
+	int64_t minutes_scaled = value - degrees * f->scale * 100;
+	int64_t result = degrees * 10000000 + (minutes_scaled * 10000000) / ((int64_t)f->scale * 60);
+	return f->value < 0 ? -result : result;
+}
+
+static uint64_t now_ns(void){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static uint64_t now_cycles(void){
+#ifdef HAVE_CYCLE_COUNTER
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
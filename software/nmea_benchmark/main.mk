@@ -0,0 +1,14 @@
+BUILD_DIR  := build/targets
+
+TARGET_DIR := build
+
+SOURCES := \
+    main.c \
+    ../obdlogger/Sources/nmea_parser.c \
+    ../obdlogger/Sources/minmea.c
+
+TGT_INCDIRS := ../obdlogger/Sources ../common
+
+TGT_CFLAGS := -std=gnu11 -O2 -Wall
+
+TARGET :=nmea_benchmark
@@ -16,6 +16,7 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "acquisition_task.h"
+#include "geofence.h"
 #include "application_tasks.h"
 #include "diagnostics.h"
 #include "logger_core.h"
@@ -30,14 +31,90 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MAX_CHANNELS 150
 #define MAX_PID_FAILURES 3
 
+/* Adaptive channels shorten their sampling interval when the value changes quickly
+ * and back off when it is flat. Peak-to-peak change over the last few samples
+ * is compared against fractions of the PID value range.
+ */
+#define MAX_ADAPTIVE_CHANNELS 16
+#define ADAPTIVE_HISTORY_LENGTH 4
+#define ADAPTIVE_FAST_CHANGE_DIVISOR 64  //change above 1/64 of the range - speed up
+#define ADAPTIVE_FLAT_DIVISOR 256        //change below 1/256 of the range - back off
+#define ADAPTIVE_PID_REQUESTS_PER_SECOND_MAX 10 //bus budget, adaptive channels don't speed up beyond it
+                                                //(acquisition_set_request_budget() overrides it)
+
+/* Burst channels are always sampled at the burst interval, but outside of a burst
+ * only one sample per normal interval is written to the log. The remaining samples
+ * go to the pre-trigger ring buffer in logger_core. When a trigger fires the ring
+ * buffer is flushed and all samples are logged until the trigger hold time elapses.
+ */
+#define MAX_BURST_CHANNELS 8
+#define MAX_TRIGGERS 4
+#define MAX_PROFILE_SECTIONS 8
+
 #define AUTODETECT_PIDS_MASK 0x80 //this can't overlap obd_protocol_t bits
 
+typedef struct {
+	uint8_t channel_index;
+	uint8_t history_index;
+	uint8_t history_filled; //samples in history, the interval isn't changed until it is full
+	uint16_t history[ADAPTIVE_HISTORY_LENGTH]; //raw PID values
+	TickType_t interval_min;
+	TickType_t interval_max;
+} adaptive_state_t;
+
+typedef struct {
+	uint8_t channel_index;
+	TickType_t interval_normal;
+	TickType_t last_logged_timestamp;
+} burst_state_t;
+
+typedef struct {
+	pid_mode_t pid_mode;
+	uint8_t pid;
+	trigger_operator_t op;
+	bool has_last_value;
+	uint16_t threshold;
+	uint16_t last_value;
+	TickType_t last_timestamp;
+	TickType_t hold_ticks;
+} trigger_t;
+
 static acquisition_channel_t _channel[MAX_CHANNELS];
 static uint32_t _channel_count;
 
+static adaptive_state_t _adaptive[MAX_ADAPTIVE_CHANNELS];
+static uint32_t _adaptive_count;
+
+static burst_state_t _burst[MAX_BURST_CHANNELS];
+static uint32_t _burst_count;
+
+static trigger_t _trigger[MAX_TRIGGERS];
+static uint32_t _trigger_count;
+static bool _burst_active;
+static TickType_t _burst_end_timestamp;
+
+//channels added after acquisition_begin_profile() belong to that profile until the next call,
+//kept as index ranges so the channel table doesn't grow
+typedef struct {
+	uint8_t first_channel;
+	uint8_t profile;
+} profile_section_t;
+
+static profile_section_t _profile_section[MAX_PROFILE_SECTIONS];
+static uint32_t _profile_section_count;
+static volatile uint8_t _active_profile = GEOFENCE_PROFILE_OUTSIDE; //changed by the storage task
+
 static volatile obd_protocol_t _startup_protocol = obd_proto_none;
+static uint32_t _request_budget; //PID requests per second, 0 - no limit
 
 static void autodetect_pids(void);
+static uint16_t pid_raw_value(const acquisition_channel_t *channel, const obd_pid_response_t *pid_response, uint32_t *range);
+static void adaptive_update(uint32_t channel_index, uint16_t value, uint32_t range);
+static void triggers_evaluate(const acquisition_channel_t *channel, uint16_t value);
+static bool burst_should_log(uint32_t channel_index);
+static uint32_t pid_request_load_mrps(void);
+static void request_budget_apply(void);
+static bool channel_in_active_profile(uint32_t channel_index);
 
 void acquisition_task(void *params __attribute__((unused))){
 
@@ -51,6 +128,7 @@ void acquisition_task(void *params __attribute__((unused))){
 	if (_startup_protocol & AUTODETECT_PIDS_MASK){
 		autodetect_pids();
 	}
+	request_budget_apply();
 
 	debugf("Starting acquisition loop, %ld channels total", _channel_count);
 
@@ -60,20 +138,34 @@ void acquisition_task(void *params __attribute__((unused))){
 		obd_task();
 
 		for (uint32_t i = 0; i < _channel_count; i++){ //loop through all channels
-			if (xTaskGetTickCount() >= _channel[i].next_sample_timestamp){
+			if (xTaskGetTickCount() >= _channel[i].next_sample_timestamp && channel_in_active_profile(i)){
 				switch (_channel[i].channel_type){
 				case logger_frame_pid:
 					do {
 						obd_pid_response_t pid_response;
 						int32_t status = obd_get_pid(_channel[i].pid_mode, _channel[i].pid, &pid_response);
 						if (status > 0){
-							log_pid(_channel[i].pid_mode,
-									_channel[i].pid,
-									pid_response.byte_a,
-									pid_response.byte_b,
-									pid_response.byte_c,
-									pid_response.byte_d);
+							uint32_t range;
+							uint16_t value = pid_raw_value(&_channel[i], &pid_response, &range);
+							triggers_evaluate(&_channel[i], value);
+
+							if (burst_should_log(i)){
+								log_pid(_channel[i].pid_mode,
+										_channel[i].pid,
+										pid_response.byte_a,
+										pid_response.byte_b,
+										pid_response.byte_c,
+										pid_response.byte_d);
+							} else {
+								log_pid_pretrigger(_channel[i].pid_mode,
+										_channel[i].pid,
+										pid_response.byte_a,
+										pid_response.byte_b,
+										pid_response.byte_c,
+										pid_response.byte_d);
+							}
 							_channel[i].failure_count = 0;
+							adaptive_update(i, value, range);
 
 //							debugf("Read channel %d PID %02X", (unsigned int)i,	_channel[i].pid);
 						} else {
@@ -85,7 +177,7 @@ void acquisition_task(void *params __attribute__((unused))){
 										_channel[i].pid);
 							}
 						}
-						vTaskDelay(pdMS_TO_TICKS(40));
+						vTaskDelay(obd_get_request_gap_ticks());
 					} while (0);
 					break;
 				case logger_frame_gps: log_gps(); break;
@@ -97,11 +189,12 @@ void acquisition_task(void *params __attribute__((unused))){
 
 				if (_channel[i].channel_type != logger_frame_disabled){
 					if (_channel[i].interval){ //normal sampling interval
-						_channel[i].next_sample_timestamp = xTaskGetTickCount() + _channel[i].interval;
-						debugf("Channel %ld next sample time %ld", i, _channel[i].next_sample_timestamp);
-						if (_channel[i].interval < sleep_time_ticks){
-							sleep_time_ticks = _channel[i].interval;
+						_channel[i].next_sample_timestamp += _channel[i].interval;
+						if (_channel[i].next_sample_timestamp <= xTaskGetTickCount()){
+							//sampling fell behind (bus slower than requested rate) - don't try to catch up
+							_channel[i].next_sample_timestamp = xTaskGetTickCount() + _channel[i].interval;
 						}
+						debugf("Channel %ld next sample time %ld", i, _channel[i].next_sample_timestamp);
 					} else { //if sampling interval is zero - sample only once and disable further sampling
 						_channel[i].channel_type = logger_frame_disabled;
 						debugf("Channel %ld sampled once, disabling", i);
@@ -110,6 +203,20 @@ void acquisition_task(void *params __attribute__((unused))){
 			}
 		}
 
+		//sleep until the earliest channel is due
+		TickType_t now = xTaskGetTickCount();
+		for (uint32_t i = 0; i < _channel_count; i++){
+			if (_channel[i].channel_type != logger_frame_disabled && channel_in_active_profile(i)){
+				if (_channel[i].next_sample_timestamp <= now){
+					sleep_time_ticks = 0;
+					break;
+				}
+				if (_channel[i].next_sample_timestamp - now < sleep_time_ticks){
+					sleep_time_ticks = _channel[i].next_sample_timestamp - now;
+				}
+			}
+		}
+
 		static TickType_t last_check = 0;
 		if (xTaskGetTickCount() - last_check > pdMS_TO_TICKS(20000)){
 			UBaseType_t stack_water_mark = uxTaskGetStackHighWaterMark(&acquisition_task_handle);
@@ -117,7 +224,9 @@ void acquisition_task(void *params __attribute__((unused))){
 			debugf("time %ld stack left %ld next sleep %ld ticks", last_check, stack_water_mark*sizeof(UBaseType_t), sleep_time_ticks);
 		}
 
-		vTaskDelay(sleep_time_ticks);
+		if (sleep_time_ticks){
+			vTaskDelay(sleep_time_ticks);
+		}
 	} //end of task loop
 } //end of acquisition_task
 
@@ -131,9 +240,28 @@ void acquisition_start(obd_protocol_t first_protocol_to_try, bool use_default_co
 	if (use_default_config){
 		_startup_protocol |= AUTODETECT_PIDS_MASK;
 	}
+
+	//all burst channels share the pre-trigger ring of logger_core, at most every sample goes there
+	uint32_t burst_load = 0;
+	for (uint32_t i = 0; i < _burst_count; i++){
+		burst_load += (1000 * configTICK_RATE_HZ) / _channel[_burst[i].channel_index].interval;
+	}
+	log_pretrigger_window_fit(burst_load);
 }
 
-void acquisition_add_channel(const acquisition_channel_t *channel){
+bool acquisition_add_channel(const acquisition_channel_t *channel){
+	//the same signal listed twice in one profile section would be requested twice as often,
+	//the first line wins
+	uint32_t first = _profile_section_count ? _profile_section[_profile_section_count-1].first_channel : 0;
+	for (uint32_t i = first; i < _channel_count; i++){
+		if (_channel[i].channel_type == channel->channel_type &&
+				(channel->channel_type != logger_frame_pid ||
+				(_channel[i].pid_mode == channel->pid_mode && _channel[i].pid == channel->pid))){
+			debugf("Channel type %d PID %02X is a duplicate of channel %ld, ignored", channel->channel_type, channel->pid, i);
+			return false;
+		}
+	}
+
 	if (_channel_count < MAX_CHANNELS-1){
 		memcpy(&_channel[_channel_count], channel, sizeof(acquisition_channel_t));
 		_channel[_channel_count].failure_count = 0;
@@ -144,8 +272,286 @@ void acquisition_add_channel(const acquisition_channel_t *channel){
 				channel->pid,
 				(uint32_t)channel->interval);
 		_channel_count++;
+		return true;
 	} else {
 		debugf("Too many channels!");
+		return false;
+	}
+}
+
+void acquisition_begin_profile(uint8_t profile){
+	if (_profile_section_count >= MAX_PROFILE_SECTIONS){
+		debugf("Too many profile sections");
+		return;
+	}
+	_profile_section[_profile_section_count].first_channel = _channel_count;
+	_profile_section[_profile_section_count].profile = profile;
+	_profile_section_count++;
+}
+
+void acquisition_set_profile(uint8_t profile){
+	_active_profile = profile;
+}
+
+static bool channel_in_active_profile(uint32_t channel_index){
+	uint8_t profile = 0; //channels before the first section are always sampled
+	for (uint32_t i = 0; i < _profile_section_count && _profile_section[i].first_channel <= channel_index; i++){
+		profile = _profile_section[i].profile;
+	}
+	return profile == 0 || profile == _active_profile;
+}
+
+bool acquisition_add_adaptive_channel(const acquisition_channel_t *channel, TickType_t interval_max){
+	if (_adaptive_count >= MAX_ADAPTIVE_CHANNELS ||
+			channel->channel_type != logger_frame_pid ||
+			channel->interval == 0 ||
+			interval_max <= channel->interval){
+		//a full adaptive table falls back to the slower rate, so it can't overload the bus
+		debugf("Channel PID %02X can't be adaptive, using fixed rate", channel->pid);
+		acquisition_channel_t fixed_channel = *channel;
+		if (interval_max > channel->interval){
+			fixed_channel.interval = interval_max;
+		}
+		return acquisition_add_channel(&fixed_channel);
+	}
+
+	//sampling starts at the back-off interval and speeds up on the first transient
+	acquisition_channel_t slow_channel = *channel;
+	slow_channel.interval = interval_max;
+	uint32_t channel_index = _channel_count;
+	if (acquisition_add_channel(&slow_channel) == false){
+		return false;
+	}
+
+	adaptive_state_t *a = &_adaptive[_adaptive_count];
+	memset(a, 0, sizeof(adaptive_state_t));
+	a->channel_index = channel_index;
+	a->interval_min = channel->interval;
+	a->interval_max = interval_max;
+	_adaptive_count++;
+	debugf("Channel %ld adaptive, interval %ld-%ld", channel_index, (uint32_t)a->interval_min, (uint32_t)a->interval_max);
+	return true;
+}
+
+static uint16_t pid_raw_value(const acquisition_channel_t *channel, const obd_pid_response_t *pid_response, uint32_t *range){
+	//value built from bytes A and B, used by adaptive sampling and triggers
+	if (obd_pid_get_length(channel->pid_mode, channel->pid) == 1){
+		*range = UINT8_MAX;
+		return pid_response->byte_a;
+	}
+	*range = UINT16_MAX;
+	return pid_response->byte_a << 8 | pid_response->byte_b;
+}
+
+static void adaptive_update(uint32_t channel_index, uint16_t value, uint32_t range){
+	adaptive_state_t *a = NULL;
+	for (uint32_t i = 0; i < _adaptive_count; i++){
+		if (_adaptive[i].channel_index == channel_index){
+			a = &_adaptive[i];
+			break;
+		}
+	}
+	if (a == NULL){
+		return; //fixed rate channel
+	}
+
+	acquisition_channel_t *channel = &_channel[channel_index];
+	if (a->history_filled == 0){
+		//the zeroed history would look like a transient
+		for (uint32_t i = 0; i < ADAPTIVE_HISTORY_LENGTH; i++){
+			a->history[i] = value;
+		}
+	}
+	a->history[a->history_index] = value;
+	a->history_index = (a->history_index + 1) % ADAPTIVE_HISTORY_LENGTH;
+	if (a->history_filled < ADAPTIVE_HISTORY_LENGTH){
+		a->history_filled++;
+		return;
+	}
+
+	uint16_t min = value;
+	uint16_t max = value;
+	for (uint32_t i = 0; i < ADAPTIVE_HISTORY_LENGTH; i++){
+		if (a->history[i] < min){
+			min = a->history[i];
+		}
+		if (a->history[i] > max){
+			max = a->history[i];
+		}
+	}
+	uint32_t peak_to_peak = max - min;
+
+	TickType_t interval = channel->interval;
+	if (peak_to_peak > range / ADAPTIVE_FAST_CHANGE_DIVISOR){ //transient - speed up
+		TickType_t faster = interval / 2;
+		if (faster < a->interval_min){
+			faster = a->interval_min;
+		}
+		if (faster < interval){
+			uint32_t load = pid_request_load_mrps()
+					- (1000 * configTICK_RATE_HZ) / interval
+					+ (1000 * configTICK_RATE_HZ) / faster;
+			uint32_t budget = _request_budget ? _request_budget : ADAPTIVE_PID_REQUESTS_PER_SECOND_MAX;
+			if (load <= budget * 1000){
+				interval = faster;
+			}
+		}
+	} else if (_burst_active){
+		interval = a->interval_min; //don't back off during a burst
+	} else if (peak_to_peak <= range / ADAPTIVE_FLAT_DIVISOR){ //flat - back off
+		interval += interval / 4 + 1;
+		if (interval > a->interval_max){
+			interval = a->interval_max;
+		}
+	}
+
+	if (interval != channel->interval){
+		debugf("Channel %ld p2p %ld interval %ld -> %ld", channel_index, peak_to_peak,
+				(uint32_t)channel->interval, (uint32_t)interval);
+		channel->interval = interval;
+	}
+}
+
+static uint32_t pid_request_load_mrps(void){ //returns PID requests per 1000 seconds
+	uint32_t load = 0;
+	for (uint32_t i = 0; i < _channel_count; i++){
+		if (_channel[i].channel_type == logger_frame_pid && _channel[i].interval){
+			load += (1000 * configTICK_RATE_HZ) / _channel[i].interval;
+		}
+	}
+	return load;
+}
+
+void acquisition_set_request_budget(uint32_t requests_per_second){
+	_request_budget = requests_per_second;
+}
+
+/* When the configured PID channels together request more than the budget all PID
+ * intervals are stretched by the same factor, so their relative rates are kept.
+ * Channels of all profiles are counted, as if they were sampled at the same time.
+ */
+static void request_budget_apply(void){
+	uint32_t load = pid_request_load_mrps();
+	uint32_t budget = _request_budget * 1000;
+	if (budget == 0 || load <= budget){
+		return;
+	}
+	debugf("PID request rate %ld/1000s over budget %ld/1000s, slowing down", load, budget);
+
+	for (uint32_t i = 0; i < _channel_count; i++){
+		if (_channel[i].channel_type == logger_frame_pid){
+			_channel[i].interval = ((uint64_t)_channel[i].interval * load + budget - 1) / budget;
+		}
+	}
+	for (uint32_t i = 0; i < _adaptive_count; i++){
+		_adaptive[i].interval_min = ((uint64_t)_adaptive[i].interval_min * load + budget - 1) / budget;
+		_adaptive[i].interval_max = ((uint64_t)_adaptive[i].interval_max * load + budget - 1) / budget;
+	}
+	for (uint32_t i = 0; i < _burst_count; i++){
+		_burst[i].interval_normal = ((uint64_t)_burst[i].interval_normal * load + budget - 1) / budget;
+	}
+}
+
+bool acquisition_add_burst_channel(const acquisition_channel_t *channel, TickType_t interval_normal){
+	if (_burst_count >= MAX_BURST_CHANNELS ||
+			channel->channel_type != logger_frame_pid ||
+			channel->interval == 0 ||
+			interval_normal <= channel->interval){
+		debugf("Channel PID %02X can't be a burst channel, using fixed rate", channel->pid);
+		acquisition_channel_t fixed_channel = *channel;
+		if (interval_normal > channel->interval){
+			fixed_channel.interval = interval_normal;
+		}
+		return acquisition_add_channel(&fixed_channel);
+	}
+
+	uint32_t channel_index = _channel_count;
+	if (acquisition_add_channel(channel) == false){
+		return false;
+	}
+
+	burst_state_t *b = &_burst[_burst_count];
+	b->channel_index = channel_index;
+	b->interval_normal = interval_normal;
+	b->last_logged_timestamp = 0;
+	_burst_count++;
+	debugf("Channel %ld burst interval %ld, normal %ld", channel_index, (uint32_t)channel->interval, (uint32_t)interval_normal);
+	return true;
+}
+
+static bool burst_should_log(uint32_t channel_index){
+	for (uint32_t i = 0; i < _burst_count; i++){
+		if (_burst[i].channel_index == channel_index){
+			TickType_t now = xTaskGetTickCount();
+			if (_burst_active || now - _burst[i].last_logged_timestamp >= _burst[i].interval_normal){
+				_burst[i].last_logged_timestamp = now;
+				return true;
+			}
+			return false; //sample goes only to the pre-trigger buffer
+		}
+	}
+	return true; //not a burst channel - always log
+}
+
+void acquisition_add_trigger(pid_mode_t pid_mode, uint8_t pid, trigger_operator_t op, uint16_t threshold,
+		TickType_t hold_ticks){
+	if (_trigger_count >= MAX_TRIGGERS){
+		debugf("Too many triggers!");
+		return;
+	}
+	trigger_t *t = &_trigger[_trigger_count];
+	memset(t, 0, sizeof(trigger_t));
+	t->pid_mode = pid_mode;
+	t->pid = pid;
+	t->op = op;
+	t->threshold = threshold;
+	t->hold_ticks = hold_ticks;
+	debugf("Adding trigger %ld PID %02X op %c threshold %d", _trigger_count, pid, op, threshold);
+	_trigger_count++;
+}
+
+static void triggers_evaluate(const acquisition_channel_t *channel, uint16_t value){
+	TickType_t now = xTaskGetTickCount();
+
+	if (_burst_active && (int32_t)(now - _burst_end_timestamp) >= 0){
+		debugf("Burst end");
+		_burst_active = false;
+	}
+
+	for (uint32_t i = 0; i < _trigger_count; i++){
+		trigger_t *t = &_trigger[i];
+		if (t->pid_mode != channel->pid_mode || t->pid != channel->pid){
+			continue;
+		}
+
+		bool fired = false;
+		switch (t->op){
+		case trigger_above: fired = value > t->threshold; break;
+		case trigger_below: fired = value < t->threshold; break;
+		case trigger_changed: fired = t->has_last_value && value != t->last_value; break;
+		case trigger_rate: //absolute change per second
+			if (t->has_last_value && now != t->last_timestamp){
+				uint32_t delta = value > t->last_value ? value - t->last_value : t->last_value - value;
+				fired = delta * configTICK_RATE_HZ > (uint32_t)t->threshold * (now - t->last_timestamp);
+			}
+			break;
+		}
+		t->last_value = value;
+		t->last_timestamp = now;
+		t->has_last_value = true;
+
+		if (fired){
+			if (_burst_active == false){
+				debugf("Trigger %ld fired, value %d", i, value);
+				log_trigger(i, channel->pid_mode, channel->pid, value);
+				_burst_active = true;
+				//burst channels are due immediately
+				for (uint32_t j = 0; j < _burst_count; j++){
+					_channel[_burst[j].channel_index].next_sample_timestamp = now;
+				}
+			}
+			_burst_end_timestamp = now + t->hold_ticks; //retriggering extends the burst
+		}
 	}
 }
 
@@ -198,7 +604,17 @@ static void autodetect_pids(void){
 								channel.pid = current_pid;
 								channel.interval = S_TO_TICKS(sampling_interval_seconds);
 								channel.next_sample_timestamp = 0;
-								acquisition_add_channel(&channel);
+
+								//adaptive PIDs speed up on transients, when flat they are sampled at the default rate
+								uint16_t adaptive_min_ms =
+										obd_pid_get_adaptive_min_sampling_interval_ms(pid_mode_01, current_pid);
+								if (adaptive_min_ms && channel.interval > pdMS_TO_TICKS(adaptive_min_ms)){
+									TickType_t interval_max = channel.interval;
+									channel.interval = pdMS_TO_TICKS(adaptive_min_ms);
+									acquisition_add_adaptive_channel(&channel, interval_max);
+								} else {
+									acquisition_add_channel(&channel);
+								}
 							}
 						}
 						current_pid++;
@@ -2,6 +2,7 @@
 #define SOURCES_ACQUISITION_TASK_H_
 #include <obd/obd.h>
 #include "logger_frames.h"
+#include <stdbool.h>
 
 typedef struct {
 	logger_frame_type_t channel_type;
@@ -12,9 +13,29 @@ typedef struct {
 	TickType_t next_sample_timestamp;
 } acquisition_channel_t;
 
+typedef enum {
+	trigger_above = '>',
+	trigger_below = '<',
+	trigger_changed = 'c',
+	trigger_rate = 'r', //absolute change per second is above the threshold
+} trigger_operator_t;
+
 void acquisition_task(void *params __attribute__((unused)));
 
-void acquisition_add_channel(const acquisition_channel_t *channel);
+//add functions return false if the channel was not added (table full or a duplicate in the same profile section)
+bool acquisition_add_channel(const acquisition_channel_t *channel);
+//channel->interval is the fastest allowed interval, sampling starts at interval_max and speeds up on transients
+bool acquisition_add_adaptive_channel(const acquisition_channel_t *channel, TickType_t interval_max);
+//channel->interval is the burst sampling interval, outside of a burst samples are logged every interval_normal
+bool acquisition_add_burst_channel(const acquisition_channel_t *channel, TickType_t interval_normal);
+//threshold is compared with the raw PID value (byte A or bytes A and B)
+void acquisition_add_trigger(pid_mode_t pid_mode, uint8_t pid, trigger_operator_t op, uint16_t threshold,
+		TickType_t hold_ticks);
+//channels added after this call are sampled only when the profile is active (0 - always)
+void acquisition_begin_profile(uint8_t profile);
+//PID intervals are stretched at start if the channels request more (0 - no limit)
+void acquisition_set_request_budget(uint32_t requests_per_second);
+void acquisition_set_profile(uint8_t profile); //can be called from another task
 void acquisition_start(obd_protocol_t first_protocol_to_try, bool use_default_config);
 
 #endif /* SOURCES_ACQUISITION_TASK_H_ */
@@ -0,0 +1,193 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <FreeRTOS/include/FreeRTOS.h>
+#include "dead_reckoning.h"
+#include "gps_core.h"
+#include <misc.h>
+#include <string.h>
+
+#define DEBUG_ID DEBUG_ID_GPS_CORE
+#include <debug.h>
+
+/* Position estimate between GPS fixes.
+ *
+ * Every OBD vehicle speed sample (PID 0x0D) moves the position along the last
+ * reliable GPS course. Every GPS fix corrects it with a scalar Kalman update
+ * applied to both axes. Variances are in cm^2, gains in Q16, positions in
+ * 1e-7 degrees, so only integer arithmetic is used.
+ */
+
+#define PID_VEHICLE_SPEED 0x0D
+
+#define CM_PER_DEGREE_E7_Q16 72874 //1e-7 degree of latitude is 1.11195 cm
+#define MAX_STEP_ms 10000 //longer gaps between speed samples are not extrapolated
+#define COURSE_MIN_SPEED_MM_S 1389 //5 km/h, GPS course is noise below this speed
+#define PROCESS_NOISE_CM2_PER_S 2500 //(0.5 m)^2 per second for turns and speed errors
+#define PROCESS_NOISE_DISTANCE_SHIFT 4 //plus (distance / 16)^2 - ~6 % of the travelled distance
+#define VARIANCE_MAX_CM2 400000000 //(200 m)^2 - estimate is no longer logged
+#define GPS_VARIANCE_DEFAULT_CM2 250000 //(5 m)^2
+
+static const int16_t SIN_TABLE_Q15[91] = { //sin(0..90 degrees)
+		0, 572, 1144, 1715, 2286, 2856, 3425, 3993, 4560, 5126,
+		5690, 6252, 6813, 7371, 7927, 8481, 9032, 9580, 10126, 10668,
+		11207, 11743, 12275, 12803, 13328, 13848, 14364, 14876, 15383, 15886,
+		16383, 16876, 17364, 17846, 18323, 18794, 19260, 19720, 20173, 20621,
+		21062, 21497, 21925, 22347, 22762, 23170, 23571, 23964, 24351, 24730,
+		25101, 25465, 25821, 26169, 26509, 26841, 27165, 27481, 27788, 28087,
+		28377, 28659, 28932, 29196, 29451, 29697, 29934, 30162, 30381, 30591,
+		30791, 30982, 31163, 31335, 31498, 31650, 31794, 31927, 32051, 32165,
+		32269, 32364, 32448, 32523, 32587, 32642, 32687, 32722, 32747, 32762,
+		32767,
+};
+
+static bool _enabled;
+static bool _initialized; //first GPS fix received
+static int32_t _latitude_e7;
+static int32_t _longitude_e7;
+static uint32_t _variance_cm2;
+static uint32_t _gps_variance_cm2 = GPS_VARIANCE_DEFAULT_CM2;
+static uint16_t _course_centidegrees;
+static uint8_t _speed_kph;
+static uint64_t _last_subticks; //time of the estimate, ticks * 256 + fraction
+
+static int32_t sin_q15(uint32_t centidegrees);
+static void propagate(uint64_t subticks);
+static void correct(int32_t *estimate, int32_t measurement, uint32_t gain_q16);
+
+void dead_reckoning_enable(uint16_t gps_accuracy_m){
+	_enabled = true;
+	if (gps_accuracy_m){
+		_gps_variance_cm2 = (uint32_t)gps_accuracy_m * gps_accuracy_m * 10000;
+	}
+}
+
+void dead_reckoning_gps(const gps_fix_t *gps){
+	if (_enabled == false){
+		return;
+	}
+
+	uint64_t subticks = (uint64_t)gps->timestamp * 256 + gps->timestamp_fraction;
+	int32_t latitude = gps->latitude_e7;
+	int32_t longitude = gps->longitude_e7;
+
+	if (gps->speed_mm_s >= COURSE_MIN_SPEED_MM_S){
+		_course_centidegrees = gps->course_centidegrees;
+	}
+
+	if (unlikely(_initialized == false)){
+		_latitude_e7 = latitude;
+		_longitude_e7 = longitude;
+		_variance_cm2 = _gps_variance_cm2;
+		_last_subticks = subticks;
+		_initialized = true;
+		return;
+	}
+
+	propagate(subticks);
+	uint32_t gain_q16 = ((uint64_t)_variance_cm2 << 16) / ((uint64_t)_variance_cm2 + _gps_variance_cm2);
+	correct(&_latitude_e7, latitude, gain_q16);
+	correct(&_longitude_e7, longitude, gain_q16);
+	_variance_cm2 = ((uint64_t)_variance_cm2 * (65536 - gain_q16)) >> 16;
+}
+
+bool dead_reckoning_speed(const frame_pid_t *frame, frame_position_t *position){
+	if (likely(_enabled == false) ||
+			(frame->frame_type != logger_frame_pid && frame->frame_type != logger_frame_pretrigger_pid) ||
+			frame->mode != pid_mode_01 || frame->pid != PID_VEHICLE_SPEED){
+		return false;
+	}
+	if (_initialized == false){
+		_speed_kph = frame->a;
+		return false; //no GPS reference yet
+	}
+
+	propagate((uint64_t)frame->timestamp * 256 + frame->timestamp_fraction);
+	_speed_kph = frame->a; //used until the next sample
+
+	if (_variance_cm2 >= VARIANCE_MAX_CM2){
+		return false; //too long without GPS
+	}
+	if (frame->frame_type != logger_frame_pid){
+		return false; //samples of a burst channel outside of a burst only move the estimate
+	}
+
+	memset(position, 0, sizeof(frame_position_t));
+	position->frame_type = logger_frame_position;
+	position->timestamp = frame->timestamp;
+	position->timestamp_fraction = frame->timestamp_fraction;
+	position->latitude = _latitude_e7;
+	position->longitude = _longitude_e7;
+	uint32_t variance_dm2 = _variance_cm2 / 100;
+	uint32_t accuracy_dm = 0;
+	while ((accuracy_dm + 1) * (accuracy_dm + 1) <= variance_dm2){ //integer square root, at most 2000 steps
+		accuracy_dm++;
+	}
+	position->accuracy_dm = accuracy_dm;
+	position->course_centidegrees = _course_centidegrees;
+	position->speed_kph = _speed_kph;
+	return true;
+}
+
+static void propagate(uint64_t subticks){
+	if (subticks <= _last_subticks){
+		return; //sample older than the estimate, eg. GPS epoch logged after the speed sample
+	}
+	uint32_t elapsed_ms = ((subticks - _last_subticks) * 1000) / (256 * configTICK_RATE_HZ);
+	_last_subticks = subticks;
+	if (elapsed_ms > MAX_STEP_ms){
+		elapsed_ms = MAX_STEP_ms;
+	}
+
+	//km/h * ms / 36 = cm
+	int32_t distance_cm = ((uint32_t)_speed_kph * elapsed_ms) / 36;
+	int32_t north_cm = ((int64_t)distance_cm * sin_q15(_course_centidegrees + 9000)) >> 15; //cos
+	int32_t east_cm = ((int64_t)distance_cm * sin_q15(_course_centidegrees)) >> 15;
+
+	//cm to 1e-7 degrees, longitude degrees shrink with cos(latitude)
+	_latitude_e7 += ((int64_t)north_cm << 16) / CM_PER_DEGREE_E7_Q16;
+	int32_t cos_latitude_q15 = sin_q15(9000 - (_latitude_e7 < 0 ? -_latitude_e7 : _latitude_e7) / 100000);
+	if (cos_latitude_q15 > 0){
+		_longitude_e7 += (((int64_t)east_cm << 31) / CM_PER_DEGREE_E7_Q16) / cos_latitude_q15;
+	}
+
+	uint32_t distance_noise = (uint32_t)distance_cm >> PROCESS_NOISE_DISTANCE_SHIFT;
+	uint64_t variance = (uint64_t)_variance_cm2 + (uint64_t)PROCESS_NOISE_CM2_PER_S * elapsed_ms / 1000 + (uint64_t)distance_noise * distance_noise;
+	_variance_cm2 = variance > VARIANCE_MAX_CM2 ? VARIANCE_MAX_CM2 : variance;
+}
+
+static void correct(int32_t *estimate, int32_t measurement, uint32_t gain_q16){
+	*estimate += ((int64_t)(measurement - *estimate) * gain_q16) >> 16;
+}
+
+static int32_t sin_q15(uint32_t centidegrees){
+	centidegrees %= 36000;
+	int32_t sign = 1;
+	if (centidegrees >= 18000){
+		centidegrees -= 18000;
+		sign = -1;
+	}
+	if (centidegrees > 9000){
+		centidegrees = 18000 - centidegrees;
+	}
+	uint32_t degrees = centidegrees / 100;
+	int32_t value = SIN_TABLE_Q15[degrees];
+	if (degrees < 90){ //linear interpolation between whole degrees
+		value += ((SIN_TABLE_Q15[degrees + 1] - value) * (int32_t)(centidegrees % 100)) / 100;
+	}
+	return sign * value;
+}
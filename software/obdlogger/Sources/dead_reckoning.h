@@ -0,0 +1,14 @@
+#ifndef SOURCES_DEAD_RECKONING_H_
+#define SOURCES_DEAD_RECKONING_H_
+#include "gps_core.h"
+#include "logger_frames.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+//Functions to be called only from the storage task
+void dead_reckoning_enable(uint16_t gps_accuracy_m); //0 = default accuracy
+void dead_reckoning_gps(const gps_fix_t *gps); //called with every valid fix
+//returns true and fills position when frame is a vehicle speed sample, pre-trigger samples only update the estimate
+bool dead_reckoning_speed(const frame_pid_t *frame, frame_position_t *position);
+
+#endif /* SOURCES_DEAD_RECKONING_H_ */
@@ -18,6 +18,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define DEBUG_ID DEBUG_ID_DEBUG //must be defined before including debug.h
 
 #include "debug.h"
+#include "application_tasks.h"
 #include <FatFS/ff.h>
 #include "file_paths.h"
 #include <FreeRTOS/include/FreeRTOS.h>
@@ -25,6 +26,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <FreeRTOS/include/task.h>
 #include <MKE06Z4.h>
 #include <inttypes.h>
+#include <misc.h>
 #include <proginfo.h>
 #include <SEGGER/SEGGER_RTT.h>
 #include <stdbool.h>
@@ -33,16 +35,75 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include "version.h"
 
+/* Lines for the debug file are not formatted on the target. Each call stores the
+ * address of its format string and the raw arguments in a binary ring, the storage
+ * task copies the ring to obdlog/debug/logNNNNN.bin. software/debug_decoder formats
+ * the file on the host with the strings from the firmware ELF file.
+ *
+ * Record: 0xDB, length (bytes after this field), uint32 tick, uint32 format address,
+ * then per conversion a uint32 value, or for %s a length byte and the characters -
+ * length 0xFF is followed by the uint32 address of a string in flash.
+ *
+ * Text is formatted only for the RTT output, which is on until the debug file is
+ * opened and can be switched by the console command "t 0|1".
+ *
+ * Lines that don't fit in the ring are counted and reported by a "lines dropped"
+ * record when the storage task gets to the ring again. What is dropped is set in
+ * debug.cfg: the newest line (default), the oldest lines, or the caller waits up to
+ * DEBUG_BLOCK_TICKS for space. A channel can also be limited to a number of lines
+ * per second, so a chatty module does not change the timing that is being debugged.
+ */
 #define MAX_LINE_LENGTH 100
-#define DEBUG_QUEUE_LENGTH 15
+#define MAX_RECORD_LENGTH 64
+#define DEBUG_RING_SIZE 512 //power of 2
+#define RECORD_SYNC 0xDB
+#define RECORD_FLASH_STRING 0xFF
+#define FLASH_END 0x00020000 //strings below are constant and logged by address
+#define DEBUG_BLOCK_TICKS 2
+#define DROPPED_LINES_FORMAT " %ld lines dropped, %ld over the rate limit\n"
+#define DEBUG_FILE_COUNTER_MAGIC 0x4E474244 //"DBGN"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t next_number;
+	uint32_t next_number_inverted; //torn write check
+} debug_file_counter_t;
 
 static StaticSemaphore_t _RTT_mutex;
 static SemaphoreHandle_t _RTT_mutex_handle;
-static QueueHandle_t _debug_log_queue_handle;
+static uint8_t _debug_ring[DEBUG_RING_SIZE];
+static volatile uint16_t _debug_ring_head; //free running, masked when used as index
+static volatile uint16_t _debug_ring_tail;
+static bool _rtt_text_output = true;
+static volatile bool _debug_ring_writing = false; //storage task is writing from the tail, it must not move
+
+typedef enum {
+	debug_policy_drop_newest = 0,
+	debug_policy_drop_oldest,
+	debug_policy_block,
+} debug_policy_t;
+
+static debug_policy_t _debug_policy = debug_policy_drop_newest;
+static uint8_t _debug_rate_limit = 0; //lines per second per channel, 0 - no limit
+static uint8_t _debug_rate_count[DEBUG_ID_COUNT];
+static TickType_t _debug_rate_window_start;
+static uint32_t _lost_lines; //not reported yet
+static uint32_t _rate_limited_lines; //not reported yet
+static uint32_t _debug_bytes_written; //since boot
 
 static FIL _debug_log_file_handle;
 static bool _debug_file_ready = false;
 
+static uint32_t debug_file_next_number(void);
+static uint32_t debug_file_scan(void);
+static bool debug_file_exists(uint32_t number);
+static uint32_t debug_encode(uint8_t *record, uint32_t size, const char *format, va_list args);
+static void put_u32(uint8_t *buffer, uint32_t value);
+static bool rate_limited(debug_id_t id);
+static void ring_push(const uint8_t *record, uint32_t length);
+static void ring_push_line(const char *format, ...);
+static uint16_t ring_free(void);
+
 static bool _debug_channel_enable[DEBUG_ID_COUNT] = {
 		[DEBUG_ID_DISABLED]         = false,
 		[DEBUG_ID_MAIN]             = false,
@@ -78,40 +139,45 @@ static const bool DEBUG_CHANNELS_ENABLED_UNDER_DEBUGGER[DEBUG_ID_COUNT] = {
 };
 
 void debug_printf(debug_id_t id, const char *format, ...){
-	if (_debug_channel_enable[id]){
-		va_list args;
-		va_start(args, format);
+	if (_debug_channel_enable[id] == false || rate_limited(id)){
+		return;
+	}
+	va_list args;
 
+	if (_rtt_text_output){
+		va_start(args, format);
 		char line_buffer[MAX_LINE_LENGTH];
 		int prefix_length = snprintf(line_buffer, sizeof(line_buffer), "%ld", (uint32_t)xTaskGetTickCount());
 		int line_length = vsnprintf(line_buffer+prefix_length, sizeof(line_buffer)-prefix_length-1, format, args);
+		va_end(args);
 
 		line_buffer[sizeof(line_buffer)-1] = '\0';
+		if (prefix_length + line_length > (int)sizeof(line_buffer) - 1){
+			line_length = sizeof(line_buffer) - 1 - prefix_length; //truncated
+		}
 
 		xSemaphoreTake(_RTT_mutex_handle, portMAX_DELAY);
 		SEGGER_RTT_Write(0/*BufferIndex*/, line_buffer, prefix_length+line_length);
 		xSemaphoreGive(_RTT_mutex_handle);
+	}
 
-		if (_debug_file_ready){
-			if (xQueueSendToBack(_debug_log_queue_handle, line_buffer, 0/*don't wait if queue is full*/) == errQUEUE_FULL){
-				//TODO: count lost lines
-			}
-		}
+	if (_debug_file_ready){
+		uint8_t record[MAX_RECORD_LENGTH];
+		va_start(args, format);
+		uint32_t length = debug_encode(record, sizeof(record), format, args);
+		va_end(args);
+
+		ring_push(record, length);
 	}
 }
 
 void debug_init(void){
 	_RTT_mutex_handle = xSemaphoreCreateMutexStatic(&_RTT_mutex);
 //	memcpy(_debug_channel_enable, DEBUG_CHANNELS_ENABLED_UNDER_DEBUGGER, sizeof(_debug_channel_enable));
+}
 
-	static StaticQueue_t queue_control_struct;
-	static uint8_t debug_log_queue[MAX_LINE_LENGTH * DEBUG_QUEUE_LENGTH];
-
-	_debug_log_queue_handle = xQueueCreateStatic(
-			DEBUG_QUEUE_LENGTH,
-			MAX_LINE_LENGTH,
-			debug_log_queue,
-			&queue_control_struct);
+void debug_rtt_text_output(bool enable){
+	_rtt_text_output = enable;
 }
 
 void debug_enable_id(debug_id_t id, bool enable){
@@ -150,6 +216,25 @@ void debug_file_init(void){
 			}
 			p++;
 		}
+
+		//optional lines after it:
+		//P newest|oldest|block - what is dropped when the buffer is full (P block - wait a while)
+		//L LINES_PER_SECOND - limit of every channel, 0 - no limit
+		while (f_gets(buffer, sizeof(buffer), &_debug_log_file_handle)){
+			if (buffer[0] == 'P' && buffer[1] == ' '){
+				if (buffer[2] == 'o'){
+					_debug_policy = debug_policy_drop_oldest;
+				} else if (buffer[2] == 'b'){
+					_debug_policy = debug_policy_block;
+				} else {
+					_debug_policy = debug_policy_drop_newest;
+				}
+			} else if (buffer[0] == 'L' && buffer[1] == ' '){
+				int x = atoi(buffer + 2);
+				_debug_rate_limit = x > UINT8_MAX ? UINT8_MAX : x;
+			}
+		}
+		debugf("drop policy %d, rate limit %d", _debug_policy, _debug_rate_limit);
 		f_close(&_debug_log_file_handle);
 	}
 
@@ -164,30 +249,76 @@ void debug_file_init(void){
 		return;
 	}
 
-	//find the next debug log filename
+	uint32_t log_file_number = debug_file_next_number();
+
+	//create debug log file
+	char debug_file_path[27];
+	snprintf(debug_file_path, sizeof(debug_file_path), DEBUG_FILE_PATH_FORMAT, (unsigned int)log_file_number);
+	debugf("Saving debug to file %s", debug_file_path);
+	r = f_open(&_debug_log_file_handle, debug_file_path, FA_CREATE_ALWAYS | FA_WRITE);
+	debugf("debug file open file status = %d", r);
+	if (r == FR_OK || r == FR_EXIST){
+		_debug_file_ready = true;
+
+		prog_info_t *pi = (prog_info_t*)PROG_INFO_OFFSET;
+
+		debugf("Debug started, bootloader %d.%d, application %d.%d",
+				pi->version_major, pi->version_minor,
+				SOFTWARE_VERSION_MAJOR, SOFTWARE_VERSION_MINOR);
+		_rtt_text_output = false; //formatting is left to the host from now on
+	}
+}
+
+static uint32_t debug_file_next_number(void){
+	/* The next file number is kept in DEBUG_FILE_COUNTER_PATH, so the boot time does
+	 * not grow with the number of debug files. The directory is scanned only when the
+	 * counter is missing, damaged or does not match the files (card edited on a PC).
+	 */
+	debug_file_counter_t counter;
+	UINT bytes = 0;
+	FRESULT r = f_open(&_debug_log_file_handle, DEBUG_FILE_COUNTER_PATH, FA_OPEN_ALWAYS | FA_READ | FA_WRITE);
+	if (r != FR_OK){
+		debugf("debug counter open %d", r);
+		return debug_file_scan();
+	}
+
+	r = f_read(&_debug_log_file_handle, &counter, sizeof(counter), &bytes);
+	uint32_t number = counter.next_number;
+	bool valid = r == FR_OK && bytes == sizeof(counter) &&
+			counter.magic == DEBUG_FILE_COUNTER_MAGIC &&
+			counter.next_number_inverted == ~counter.next_number &&
+			debug_file_exists(number) == false &&
+			(number == 0 || debug_file_exists(number - 1));
+	if (valid == false){
+		number = debug_file_scan();
+	}
+
+	counter.magic = DEBUG_FILE_COUNTER_MAGIC;
+	counter.next_number = number + 1;
+	counter.next_number_inverted = ~counter.next_number;
+	f_lseek(&_debug_log_file_handle, 0);
+	f_write(&_debug_log_file_handle, &counter, sizeof(counter), &bytes);
+	f_close(&_debug_log_file_handle);
+	return number;
+}
+
+static uint32_t debug_file_scan(void){
+	//find the number after the highest one of files like "log12345.bin"
 	uint32_t log_file_number = 0;
 	DIR dir;
 	FILINFO fno;
-	r = f_opendir(&dir, DEBUG_FILE_DIRECTORY);                       /* Open the directory */
+	FRESULT r = f_opendir(&dir, DEBUG_FILE_DIRECTORY);
 	if (r == FR_OK) {
 		for (;;) {
 			r = f_readdir(&dir, &fno); //read directory item
 			if (r != FR_OK || fno.fname[0] == 0){
 				break; //all elements in directory have been read
 			}
-			if ((fno.fattrib & AM_DIR) == 0) { //it is a file, not directory
-				if (fno.fname[0] == 'L' && //look only for files like "log12345.txt"
-						fno.fname[1] == 'O' &&
-						fno.fname[2] == 'G' &&
-						fno.fname[9] == 'T' &&
-						fno.fname[10] == 'X' &&
-						fno.fname[11] == 'T'
-				){
-					fno.fname[8] = '\0';
-					uint32_t v = atoi(fno.fname+3);
-					if (v >= log_file_number){
-						log_file_number = v + 1;
-					}
+			//8.3 names are upper case
+			if ((fno.fattrib & AM_DIR) == 0 && memcmp(fno.fname, "LOG", 3) == 0 && strcmp(fno.fname + 8, ".BIN") == 0){
+				uint32_t v = strtoul(fno.fname + 3, NULL, 10);
+				if (v >= log_file_number){
+					log_file_number = v + 1;
 				}
 			}
 		}
@@ -195,34 +326,185 @@ void debug_file_init(void){
 	} else {
 		debugf("No debug directory?");
 	}
+	debugf("debug directory scanned, next file %ld", log_file_number);
+	return log_file_number;
+}
 
-	//create debug log file
-	char debug_file_path[27];
-	snprintf(debug_file_path, sizeof(debug_file_path), DEBUG_FILE_PATH_FORMAT, (unsigned int)log_file_number);
-	debugf("Saving debug to file %s", debug_file_path);
-	r = f_open(&_debug_log_file_handle, debug_file_path, FA_CREATE_ALWAYS | FA_WRITE);
-	debugf("debug file open file status = %d", r);
-	if (r == FR_OK || r == FR_EXIST){
-		_debug_file_ready = true;
+static uint32_t debug_encode(uint8_t *record, uint32_t size, const char *format, va_list args){
+	uint32_t n = 2; //sync and length bytes
+	put_u32(record + n, xTaskGetTickCount());
+	n += 4;
+	put_u32(record + n, (uint32_t)(uintptr_t)format);
+	n += 4;
 
-		prog_info_t *pi = (prog_info_t*)PROG_INFO_OFFSET;
+	//all conversions used are 32 bit integers or strings
+	for (const char *p = format; *p; p++){
+		if (*p != '%'){
+			continue;
+		}
+		p++;
+		while (*p && strchr("-+ #0123456789.lhz", *p)){ //flags, width and length modifiers
+			p++;
+		}
+		if (*p == '\0'){
+			break;
+		} else if (*p == '%'){
+			continue;
+		} else if (*p == 's'){
+			const char *s = va_arg(args, const char*);
+			if ((uintptr_t)s < FLASH_END){
+				if (n + 5 > size){
+					break;
+				}
+				record[n++] = RECORD_FLASH_STRING;
+				put_u32(record + n, (uint32_t)(uintptr_t)s);
+				n += 4;
+			} else {
+				if (n + 1 > size){
+					break;
+				}
+				uint32_t length = strnlen(s, size - n - 1);
+				record[n++] = length;
+				memcpy(record + n, s, length);
+				n += length;
+			}
+		} else {
+			uint32_t value = va_arg(args, uint32_t);
+			if (n + 4 > size){
+				break;
+			}
+			put_u32(record + n, value);
+			n += 4;
+		}
+	}
 
-		debugf("Debug started, bootloader %d.%d, application %d.%d",
-				pi->version_major, pi->version_minor,
-				SOFTWARE_VERSION_MAJOR, SOFTWARE_VERSION_MINOR);
+	record[0] = RECORD_SYNC;
+	record[1] = n - 2;
+	return n;
+}
+
+static bool rate_limited(debug_id_t id){
+	if (_debug_rate_limit == 0){
+		return false;
+	}
+	taskENTER_CRITICAL();
+	TickType_t now = xTaskGetTickCount();
+	if (now - _debug_rate_window_start >= configTICK_RATE_HZ){
+		_debug_rate_window_start = now;
+		memset(_debug_rate_count, 0, sizeof(_debug_rate_count));
+	}
+	bool limited = _debug_rate_count[id] >= _debug_rate_limit;
+	if (limited){
+		_rate_limited_lines++;
+	} else {
+		_debug_rate_count[id]++;
+	}
+	taskEXIT_CRITICAL();
+	return limited;
+}
+
+static void ring_push(const uint8_t *record, uint32_t length){
+	//the storage task empties the ring, it can't wait for itself
+	bool may_block = _debug_policy == debug_policy_block &&
+			xTaskGetSchedulerState() == taskSCHEDULER_RUNNING &&
+			xTaskGetCurrentTaskHandle() != (TaskHandle_t)&storage_task_handle;
+	TickType_t start = xTaskGetTickCount();
+
+	for (;;){
+		bool done = true;
+		taskENTER_CRITICAL();
+		if (_debug_policy == debug_policy_drop_oldest && _debug_ring_writing == false){
+			while (ring_free() < length){ //records are whole from the tail on
+				_debug_ring_tail += 2 + _debug_ring[(_debug_ring_tail + 1) & (DEBUG_RING_SIZE - 1)];
+				_lost_lines++;
+			}
+		}
+		if (ring_free() >= length){
+			uint16_t head = _debug_ring_head;
+			for (uint32_t i = 0; i < length; i++){
+				_debug_ring[(head + i) & (DEBUG_RING_SIZE - 1)] = record[i];
+			}
+			_debug_ring_head = head + length;
+		} else if (may_block && xTaskGetTickCount() - start < DEBUG_BLOCK_TICKS){
+			done = false;
+		} else {
+			_lost_lines++;
+		}
+		taskEXIT_CRITICAL();
+
+		if (done){
+			return;
+		}
+		vTaskDelay(1);
 	}
 }
 
+static void ring_push_line(const char *format, ...){
+	uint8_t record[MAX_RECORD_LENGTH];
+	va_list args;
+	va_start(args, format);
+	uint32_t length = debug_encode(record, sizeof(record), format, args);
+	va_end(args);
+	ring_push(record, length);
+}
+
+static uint16_t ring_free(void){
+	return DEBUG_RING_SIZE - (uint16_t)(_debug_ring_head - _debug_ring_tail);
+}
+
+static void put_u32(uint8_t *buffer, uint32_t value){
+	memcpy(buffer, &value, sizeof(value)); //M0+ does not allow unaligned stores
+}
+
+static bool debug_file_exists(uint32_t number){
+	char path[27];
+	snprintf(path, sizeof(path), DEBUG_FILE_PATH_FORMAT, (unsigned int)number);
+	return f_stat(path, NULL) == FR_OK;
+}
+
 void debug_file_task(void){
 	if (_debug_file_ready){
-		char line_buffer[MAX_LINE_LENGTH];
-		while (xQueueReceive(_debug_log_queue_handle, line_buffer, 0/*don't wait*/) == pdTRUE){
+		//at most two writes, the used part of the ring may wrap around
+		for (;;){
+			taskENTER_CRITICAL();
+			uint16_t tail_index = _debug_ring_tail & (DEBUG_RING_SIZE - 1);
+			uint16_t length = _debug_ring_head - _debug_ring_tail;
+			_debug_ring_writing = length != 0;
+			taskEXIT_CRITICAL();
+			if (length == 0){
+				break;
+			}
+
+			if (length > DEBUG_RING_SIZE - tail_index){
+				length = DEBUG_RING_SIZE - tail_index;
+			}
 			uint32_t bytes_written;
-			f_write(&_debug_log_file_handle, line_buffer, strlen(line_buffer), &bytes_written);
+			f_write(&_debug_log_file_handle, _debug_ring + tail_index, length, &bytes_written);
+			_debug_bytes_written += bytes_written;
+			_debug_ring_tail += length;
+			_debug_ring_writing = false;
+		}
+
+		taskENTER_CRITICAL();
+		uint32_t lost = _lost_lines;
+		uint32_t rate_limited = _rate_limited_lines;
+		_lost_lines = 0;
+		_rate_limited_lines = 0;
+		taskEXIT_CRITICAL();
+		if (unlikely(lost || rate_limited)){
+			ring_push_line(DROPPED_LINES_FORMAT, lost, rate_limited); //written with the next pass
 		}
 	}
 }
 
+uint16_t debug_file_pending(void){
+	return _debug_file_ready ? (uint16_t)(_debug_ring_head - _debug_ring_tail) : 0;
+}
+
+uint32_t debug_file_get_bytes_written(void){
+	return _debug_bytes_written;
+}
+
 void debug_sync(void){
 	if (_debug_file_ready){
 		f_sync(&_debug_log_file_handle);
@@ -2,6 +2,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef enum {
     DEBUG_ID_DISABLED = 0,
@@ -43,7 +44,10 @@ typedef enum {
 void debug_init(void); //call very early in main before any debug output
 void debug_printf(debug_id_t id, const char *format, ...) __attribute__ ((format (printf, 2, 3))); //can be called from any task
 void debug_enable_id(debug_id_t id, bool enable);
+void debug_rtt_text_output(bool enable); //formatted lines on RTT, off when the binary debug file is used
 
 void debug_file_init(void); //to be called only within the FatFS parent task
 void debug_file_task(void); //to be called only within the FatFS parent task
 void debug_sync(void); //to be called only within the FatFS parent task
+uint16_t debug_file_pending(void); //bytes waiting for debug_file_task()
+uint32_t debug_file_get_bytes_written(void); //payload bytes handed to FatFS since boot
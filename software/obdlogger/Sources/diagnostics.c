@@ -17,8 +17,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "diagnostics.h"
 #include <FreeRTOS/include/FreeRTOS.h>
+#include "seqlock.h"
 
-frame_diagnostics_t GLOBAL_diagnostics_frame = {
-		.frame_type = logger_frame_internal_diagnostics, //those fields are never changed during runtime
-		.timebase_hz = configTICK_RATE_HZ
-};
+#define DIAGNOSTICS_FRAME_INIT { \
+		.frame_type = logger_frame_internal_diagnostics, /*those fields are never changed during runtime*/ \
+		.timebase_hz = configTICK_RATE_HZ \
+}
+
+/* --------- public data ---------------- */
+frame_diagnostics_t GLOBAL_diagnostics_frame = DIAGNOSTICS_FRAME_INIT;
+
+/* --------- private data --------------- */
+static frame_diagnostics_t _published[2] = { DIAGNOSTICS_FRAME_INIT, DIAGNOSTICS_FRAME_INIT };
+static seqlock_t _published_lock = SEQLOCK_INIT(_published);
+
+/* ----------- implementation ----------- */
+
+void diagnostics_publish(void){
+	seqlock_publish(&_published_lock, &GLOBAL_diagnostics_frame);
+}
+
+void diagnostics_get(frame_diagnostics_t *target){
+	seqlock_read(&_published_lock, target);
+}
@@ -2,6 +2,10 @@
 #define SOURCES_DIAGNOSTICS_H_
 #include "logger_frames.h"
 
+//working copy, modified only by the acquisition task - call diagnostics_publish() after changes
 extern frame_diagnostics_t GLOBAL_diagnostics_frame;
 
+void diagnostics_publish(void);
+void diagnostics_get(frame_diagnostics_t *target); //consistent copy, safe to call from any task
+
 #endif /* SOURCES_DIAGNOSTICS_H_ */
@@ -2,10 +2,15 @@
 #define SOURCES_FILE_PATHS_H_
 
 #define TMP_LOG_PATH "obdlog/noname.log"
+#define RECOVERED_LOG_PATH_FORMAT "obdlog/rec%05d.log" //temporary logs without GPS time
 #define CONFIG_PATH "obdlog/config.txt"
 #define PROTOCOL_FILE_PATH "obdlog/proto.txt"
+#define POWER_FAIL_RECORD_PATH "obdlog/pwrfail.bin"
+#define LOG_INDEX_PATH "obdlog/logs.idx" //see log_space.h
+#define TRIP_INDEX_PATH "obdlog/index.bin" //see trip_summary.h
 #define DEBUG_FILE_DIRECTORY "obdlog/debug"
-#define DEBUG_FILE_PATH_FORMAT "obdlog/debug/log%05d.txt"
+#define DEBUG_FILE_PATH_FORMAT "obdlog/debug/log%05d.bin" //binary, see debug.c
+#define DEBUG_FILE_COUNTER_PATH "obdlog/debug/next.bin"
 #define DEBUG_CONFIG_FILE_PATH "obdlog/debug.cfg"
 
 #endif /* SOURCES_FILE_PATHS_H_ */
@@ -0,0 +1,220 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "acquisition_task.h"
+#include "geofence.h"
+#include "logger_core.h"
+#include <misc.h>
+#include <string.h>
+
+#define DEBUG_ID DEBUG_ID_GPS_CORE
+#include <debug.h>
+
+/* Fences are circles or polygons, each selects an acquisition profile.
+ * The first fence (in config order) that contains the position wins,
+ * outside of all fences GEOFENCE_PROFILE_OUTSIDE is active.
+ *
+ * Polygons are tested by counting edge crossings of a ray going east from the
+ * position, after a bounding box check that rejects far away fences with a
+ * few 32-bit compares. Edge tests need 64-bit products, which the M0+ does in
+ * software, but there are only a few edges per fence and one test per epoch.
+ */
+
+#define MAX_GEOFENCES 4
+#define MAX_GEOFENCE_VERTICES 24 //shared by all polygons
+#define GEOFENCE_DEBOUNCE_EPOCHS 2 //GPS noise on the boundary must not toggle the profile
+#define CM_PER_DEGREE_E7_Q16 72874 //1e-7 degree of latitude is 1.11195 cm
+
+typedef struct {
+	int32_t latitude;
+	int32_t longitude;
+} vertex_t;
+
+typedef struct {
+	uint8_t profile;
+	uint8_t vertex_count; //0 for circles
+	uint8_t first_vertex; //circle center for circles
+	uint8_t debounce;
+	bool inside;
+	int16_t cos_latitude_q15; //circles only, longitude degrees shrink with latitude
+	uint32_t radius_e7; //circles only, in 1e-7 degrees of latitude
+	vertex_t min; //bounding box
+	vertex_t max;
+} geofence_t;
+
+static geofence_t _fence[MAX_GEOFENCES];
+static uint32_t _fence_count;
+static vertex_t _vertex[MAX_GEOFENCE_VERTICES];
+static uint32_t _vertex_count;
+static uint8_t _active_profile = GEOFENCE_PROFILE_OUTSIDE;
+
+static bool fence_contains(const geofence_t *fence, int32_t latitude, int32_t longitude);
+static bool polygon_contains(const geofence_t *fence, int32_t latitude, int32_t longitude);
+static bool circle_contains(const geofence_t *fence, int32_t latitude, int32_t longitude);
+static int16_t cos_q15(int32_t degrees_e7);
+
+bool geofence_add_circle(uint8_t profile, int32_t latitude, int32_t longitude, uint32_t radius_m){
+	if (_fence_count >= MAX_GEOFENCES || _vertex_count >= MAX_GEOFENCE_VERTICES){
+		debugf("Too many geofences");
+		return false;
+	}
+	geofence_t *fence = &_fence[_fence_count];
+	memset(fence, 0, sizeof(geofence_t));
+	fence->profile = profile;
+	fence->first_vertex = _vertex_count;
+	fence->cos_latitude_q15 = cos_q15(latitude);
+	fence->radius_e7 = ((uint64_t)radius_m * 100 << 16) / CM_PER_DEGREE_E7_Q16;
+
+	//bounding box, longitude extent grows with 1/cos(latitude)
+	uint32_t radius_longitude_e7 = fence->cos_latitude_q15 > 0 ?
+			((uint64_t)fence->radius_e7 << 15) / fence->cos_latitude_q15 : 1800000000;
+	fence->min.latitude = latitude - fence->radius_e7;
+	fence->max.latitude = latitude + fence->radius_e7;
+	fence->min.longitude = longitude - radius_longitude_e7;
+	fence->max.longitude = longitude + radius_longitude_e7;
+
+	_vertex[_vertex_count].latitude = latitude;
+	_vertex[_vertex_count].longitude = longitude;
+	_vertex_count++;
+	_fence_count++;
+	debugf("Geofence %ld: circle %ld m, profile %d", _fence_count - 1, radius_m, profile);
+	return true;
+}
+
+bool geofence_add_polygon(uint8_t profile){
+	if (_fence_count >= MAX_GEOFENCES){
+		debugf("Too many geofences");
+		return false;
+	}
+	geofence_t *fence = &_fence[_fence_count];
+	memset(fence, 0, sizeof(geofence_t));
+	fence->profile = profile;
+	fence->first_vertex = _vertex_count;
+	fence->min.latitude = INT32_MAX;
+	fence->min.longitude = INT32_MAX;
+	fence->max.latitude = INT32_MIN;
+	fence->max.longitude = INT32_MIN;
+	_fence_count++;
+	debugf("Geofence %ld: polygon, profile %d", _fence_count - 1, profile);
+	return true;
+}
+
+bool geofence_add_vertex(int32_t latitude, int32_t longitude){
+	if (_fence_count == 0 || _vertex_count >= MAX_GEOFENCE_VERTICES){
+		debugf("Too many geofence vertices");
+		return false;
+	}
+	geofence_t *fence = &_fence[_fence_count - 1];
+	if (fence->first_vertex + fence->vertex_count != _vertex_count){
+		debugf("Vertex does not follow a polygon");
+		return false;
+	}
+	_vertex[_vertex_count].latitude = latitude;
+	_vertex[_vertex_count].longitude = longitude;
+	_vertex_count++;
+	fence->vertex_count++;
+
+	if (latitude < fence->min.latitude){ fence->min.latitude = latitude; }
+	if (latitude > fence->max.latitude){ fence->max.latitude = latitude; }
+	if (longitude < fence->min.longitude){ fence->min.longitude = longitude; }
+	if (longitude > fence->max.longitude){ fence->max.longitude = longitude; }
+	return true;
+}
+
+void geofence_evaluate(int32_t latitude, int32_t longitude){
+	if (likely(_fence_count == 0)){
+		return;
+	}
+
+	uint8_t profile = GEOFENCE_PROFILE_OUTSIDE;
+	bool profile_found = false;
+	for (uint32_t i = 0; i < _fence_count; i++){
+		geofence_t *fence = &_fence[i];
+		bool inside = fence_contains(fence, latitude, longitude);
+		if (inside != fence->inside){
+			fence->debounce++;
+			if (fence->debounce >= GEOFENCE_DEBOUNCE_EPOCHS){
+				fence->inside = inside;
+				fence->debounce = 0;
+				debugf("Geofence %ld %s", i, inside ? "entered" : "left");
+				log_geofence(i, inside, fence->profile);
+			}
+		} else {
+			fence->debounce = 0;
+		}
+		if (fence->inside && profile_found == false){
+			profile = fence->profile;
+			profile_found = true;
+		}
+	}
+
+	if (profile != _active_profile){
+		debugf("Switching to profile %d", profile);
+		_active_profile = profile;
+		acquisition_set_profile(profile);
+	}
+}
+
+static bool fence_contains(const geofence_t *fence, int32_t latitude, int32_t longitude){
+	if (latitude < fence->min.latitude || latitude > fence->max.latitude ||
+			longitude < fence->min.longitude || longitude > fence->max.longitude){
+		return false;
+	}
+	if (fence->vertex_count == 0){
+		return circle_contains(fence, latitude, longitude);
+	}
+	return polygon_contains(fence, latitude, longitude);
+}
+
+static bool polygon_contains(const geofence_t *fence, int32_t latitude, int32_t longitude){
+	bool inside = false;
+	const vertex_t *v = &_vertex[fence->first_vertex];
+	uint32_t count = fence->vertex_count;
+	for (uint32_t i = 0, j = count - 1; i < count; j = i++){
+		//edge from v[j] to v[i] crosses the latitude of the point
+		if ((v[i].latitude > latitude) != (v[j].latitude > latitude)){
+			//longitude of the crossing is east of the point:
+			//lon < lon_i + (lon_j - lon_i) * (lat - lat_i) / (lat_j - lat_i), without the division
+			int64_t lhs = ((int64_t)longitude - v[i].longitude) * ((int64_t)v[j].latitude - v[i].latitude);
+			int64_t rhs = ((int64_t)v[j].longitude - v[i].longitude) * ((int64_t)latitude - v[i].latitude);
+			if ((v[j].latitude > v[i].latitude) ? (lhs < rhs) : (lhs > rhs)){
+				inside = !inside;
+			}
+		}
+	}
+	return inside;
+}
+
+static bool circle_contains(const geofence_t *fence, int32_t latitude, int32_t longitude){
+	const vertex_t *center = &_vertex[fence->first_vertex];
+	int64_t dy = (int64_t)latitude - center->latitude;
+	int64_t dx = (((int64_t)longitude - center->longitude) * fence->cos_latitude_q15) >> 15;
+	return dx * dx + dy * dy <= (int64_t)fence->radius_e7 * fence->radius_e7;
+}
+
+static int16_t cos_q15(int32_t degrees_e7){
+	//Bhaskara I approximation, error below 0.2 %, only used when fences are loaded
+	int64_t d = degrees_e7 / 10000; //1e-3 degrees
+	if (d < 0){
+		d = -d;
+	}
+	if (d >= 90000){
+		return 0;
+	}
+	int64_t d2 = d * d;
+	return (int16_t)(((32400000000LL - 4 * d2) * 32767) / (32400000000LL + d2));
+}
@@ -0,0 +1,15 @@
+#ifndef SOURCES_GEOFENCE_H_
+#define SOURCES_GEOFENCE_H_
+#include <stdbool.h>
+#include <stdint.h>
+
+#define GEOFENCE_PROFILE_OUTSIDE 1 //active outside of all fences, profile 0 channels are always sampled
+
+//Functions to be called only from the storage task, coordinates are in 1e-7 degrees.
+//Fences are added from the config file before acquisition is started.
+bool geofence_add_circle(uint8_t profile, int32_t latitude, int32_t longitude, uint32_t radius_m);
+bool geofence_add_polygon(uint8_t profile); //vertices follow
+bool geofence_add_vertex(int32_t latitude, int32_t longitude); //adds to the last polygon
+void geofence_evaluate(int32_t latitude, int32_t longitude); //called on every valid GPS epoch
+
+#endif /* SOURCES_GEOFENCE_H_ */
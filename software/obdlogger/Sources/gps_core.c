@@ -16,134 +16,329 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <FreeRTOS/include/FreeRTOS.h>
+#include "dead_reckoning.h"
+#include "geofence.h"
 #include "gps_core.h"
-#include "minmea.h"
+#include "logger_core.h"
+#include "nmea_parser.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include "misc.h"
+#include "seqlock.h"
+#include "timebase.h"
+#include "trip_summary.h"
 
 #define DEBUG_ID DEBUG_ID_GPS_CORE
 #include <debug.h>
 
+/* NMEA sentences are parsed byte by byte as they arrive from the UART by
+ * nmea_parser, fields of a sentence are merged into the current epoch only
+ * after the checksum has been verified.
+ *
+ * RMC, GGA and VTG sentences of one GPS epoch (same UTC time) are fused into
+ * a single frame_gps_t, which is published through a seqlock, so readers
+ * in any task get a consistent snapshot. A fixed-point copy of the epoch
+ * (gps_fix_t) is handed to dead reckoning and geofences.
+ */
+
 /* --------- public data ---------------- */
-frame_gps_t GLOBAL_frame_gps_current = { .frame_type = logger_frame_gps, .valid = false };
 
 /* --------- private data --------------- */
+static frame_gps_t _published[2] = {
+		{ .frame_type = logger_frame_gps, .valid = false },
+		{ .frame_type = logger_frame_gps, .valid = false },
+};
+static seqlock_t _published_lock = SEQLOCK_INIT(_published);
+
+#define EPOCH_HAS_RMC 0x01
+#define EPOCH_HAS_GGA 0x02
+#define EPOCH_HAS_VTG 0x04
+#define EPOCH_COMPLETE (EPOCH_HAS_RMC | EPOCH_HAS_GGA | EPOCH_HAS_VTG)
+
+static nmea_parser_t _parser;
+static TickType_t _sentence_timestamp; //start of the burst the sentence belongs to
+static uint8_t _sentence_timestamp_fraction;
+
+static frame_gps_t _epoch = { .frame_type = logger_frame_gps };
+static gps_fix_t _epoch_fix;
+static uint8_t _epoch_mask;
+
+static bool _log_every_epoch;
+
+//the receiver sends all sentences of an epoch in one burst, its first byte is the best time reference
+static TickType_t _burst_timestamp;
+static uint8_t _burst_timestamp_fraction;
+
+/* MTK binary protocol (DIYDrones custom firmware v1.9, enabled by $PGCMD,16):
+ * <0xD1> <0xDD> <length=32> <payload> <ck_a> <ck_b>
+ * Fletcher checksum over the length byte and the payload.
+ * Payload is little-endian:
+ *  0 int32 latitude [1e-7 deg]
+ *  4 int32 longitude [1e-7 deg]
+ *  8 int32 altitude [cm]
+ * 12 int32 ground speed [cm/s]
+ * 16 int32 ground course [1e-2 deg]
+ * 20 uint8 satellites
+ * 21 uint8 fix type (1 = none, 2 = 2D, 3 = 3D, 6 = 2D SBAS, 7 = 3D SBAS)
+ * 22 uint32 UTC date DDMMYY
+ * 26 uint32 UTC time HHMMSSmmm
+ * 30 uint16 HDOP [1e-2]
+ */
+#define MTK_BINARY_PREAMBLE1 0xD1
+#define MTK_BINARY_PREAMBLE2 0xDD
+#define MTK_BINARY_PAYLOAD_LENGTH 32
+#define MTK_BINARY_FIX_2D 2
+
+typedef enum {
+	binary_state_preamble1 = 0,
+	binary_state_preamble2,
+	binary_state_length,
+	binary_state_payload,
+	binary_state_ck_a,
+	binary_state_ck_b,
+} binary_state_t;
+
+static struct {
+	binary_state_t state;
+	uint8_t index;
+	uint8_t ck_a;
+	uint8_t ck_b;
+	TickType_t timestamp; //start of the burst the packet belongs to
+	uint8_t timestamp_fraction;
+	uint8_t payload[MTK_BINARY_PAYLOAD_LENGTH];
+} _binary;
 
 /* --------- private prototypes --------- */
+static void sentence_commit(const nmea_sentence_t *sentence);
+static void epoch_publish(void);
+static void binary_commit(void);
+static int32_t binary_get_i32(uint8_t offset);
+static minmea_float_t binary_to_nmea_coordinate(int32_t degrees_e7);
 
 /* ----------- implementation ----------- */
 
-bool gps_core_consume_nmea(const char *line){
-	uint32_t timestamp = xTaskGetTickCount();
-
-    switch (minmea_sentence_id(line, false)) {
-        case MINMEA_SENTENCE_RMC: {
-            struct minmea_sentence_rmc frame;
-            if (minmea_parse_rmc(&frame, line)) {
-
-            	//always accept date from GPS - its RTC should be accurate enough without a fix
-            	memcpy(&GLOBAL_frame_gps_current.date, &frame.date, sizeof(GLOBAL_frame_gps_current.date));
-
-                if (unlikely(!frame.valid)) { return false; }
-                GLOBAL_frame_gps_current.valid = true;
-                /* ----- copying current GPS data into state struct ----- */
-                memcpy(&GLOBAL_frame_gps_current.latitude, &frame.latitude, sizeof(minmea_float_t));
-                memcpy(&GLOBAL_frame_gps_current.longitude, &frame.longitude, sizeof(minmea_float_t));
-                GLOBAL_frame_gps_current.timestamp = timestamp;
-                /* ------------------------------------------------------ */
-
-//                 debugf("$xxRMC: raw coordinates and speed: (%ld/%ld,%ld/%ld) %ld/%ld",
-//                         frame.latitude.value, frame.latitude.scale,
-//                         frame.longitude.value, frame.longitude.scale,
-//                         frame.speed.value, frame.speed.scale);
-//                 debugf("$xxRMC fixed-point coordinates and speed scaled to three decimal places: (%ld,%ld) %ld",
-//                         minmea_rescale(&frame.latitude, 1000),
-//                         minmea_rescale(&frame.longitude, 1000),
-//                         minmea_rescale(&frame.speed, 1000));
-//                 debugf("$xxRMC floating point degree coordinates and speed: (%f,%f) %f",
-//                         minmea_tocoord(&frame.latitude),
-//                         minmea_tocoord(&frame.longitude),
-//                         minmea_tofloat(&frame.speed));
-            } else {
-                debugf("$xxRMC sentence is not parsed");
-            }
-        } break;
-
-        //this sentence carries current time
-        case MINMEA_SENTENCE_GGA: {
-            struct minmea_sentence_gga frame;
-            if (minmea_parse_gga(&frame, line)) {
-                //debugf("$xxGGA: fix quality: %d", frame.fix_quality);
-                memcpy(&GLOBAL_frame_gps_current.time, &frame.time, sizeof(GLOBAL_frame_gps_current.time));
-            }
-            else {
-                debugf("$xxGGA sentence is not parsed");
-            }
-        } break;
-
-//         case MINMEA_SENTENCE_GSV: {
-//             struct minmea_sentence_gsv frame;
-//             if (minmea_parse_gsv(&frame, line)) {
-//                 debugf("$xxGSV: message %d of %d\n", frame.msg_nr, frame.total_msgs);
-//                 debugf("$xxGSV: sattelites in view: %d\n", frame.total_sats);
-//                 for (int i = 0; i < 4; i++)
-//                     debugf("$xxGSV: sat nr %d, elevation: %d, azimuth: %d, snr: %d dbm\n",
-//                         frame.sats[i].nr,
-//                         frame.sats[i].elevation,
-//                         frame.sats[i].azimuth,
-//                         frame.sats[i].snr);
-//             }
-//             else {
-//                 debugf("$xxGSV sentence is not parsed\n");
-//             }
-//         } break;
-
-        case MINMEA_SENTENCE_VTG: {
-            struct minmea_sentence_vtg frame;
-            if (minmea_parse_vtg(&frame, line)) {
-                /* ----- copying current GPS data into state struct ----- */
-                memcpy(&GLOBAL_frame_gps_current.azimuth, &frame.true_track_degrees, sizeof(minmea_float_t));
-                memcpy(&GLOBAL_frame_gps_current.speed_kph, &frame.speed_kph, sizeof(minmea_float_t));
-                GLOBAL_frame_gps_current.timestamp = timestamp;
-                /* ------------------------------------------------------ */
-
-//                 debugf("$xxVTG: true track degrees = %f",
-//                         minmea_tofloat(&frame.true_track_degrees));
-//                 debugf("        magnetic track degrees = %f",
-//                         minmea_tofloat(&frame.magnetic_track_degrees));
-//                 debugf("        speed knots = %f",
-//                         minmea_tofloat(&frame.speed_knots));
-//                 debugf("        speed kph = %f",
-//                         minmea_tofloat(&frame.speed_kph));
-            }
-            else {
-                debugf("$xxVTG sentence is not parsed");
-            }
-        } break;
-
-        case MINMEA_INVALID: {
-            debugf("sentence is not valid <%s>", line);
-            return false;
-        } break;
-
-        default: {
-            //debugf("%.8s sentence is not parsed", line);
-        } break;
-    }
-    return true;
+bool gps_core_consume_byte(char c){
+	if (c == '$'){ //first character of a sentence
+		_sentence_timestamp = _burst_timestamp;
+		_sentence_timestamp_fraction = _burst_timestamp_fraction;
+	}
+	if (nmea_parser_consume(&_parser, c)){
+		sentence_commit(&_parser.sentence);
+		return true;
+	}
+	return false;
+}
+
+void gps_core_discard_sentence(void){
+	nmea_parser_reset(&_parser);
+}
+
+void gps_core_burst_start(TickType_t ticks, uint8_t fraction){
+	_burst_timestamp = ticks;
+	_burst_timestamp_fraction = fraction;
+}
+
+void gps_core_log_every_epoch(bool enable){
+	_log_every_epoch = enable;
+}
+
+static void sentence_commit(const nmea_sentence_t *sentence){
+	uint8_t sentence_mask;
+	switch (sentence->id){
+	case nmea_sentence_rmc: sentence_mask = EPOCH_HAS_RMC; break;
+	case nmea_sentence_gga: sentence_mask = EPOCH_HAS_GGA; break;
+	case nmea_sentence_vtg: sentence_mask = EPOCH_HAS_VTG; break;
+	default: return; //sentence is not used
+	}
+
+	if (sentence->has_time){
+		if ((_epoch_mask & (EPOCH_HAS_RMC | EPOCH_HAS_GGA)) &&
+				memcmp(&sentence->time, &_epoch.time, sizeof(struct minmea_time))){
+			epoch_publish(); //a new epoch has started - publish the previous one
+		}
+		memcpy(&_epoch.time, &sentence->time, sizeof(struct minmea_time));
+	}
+	if (_epoch_mask == 0){
+		_epoch.timestamp = _sentence_timestamp; //first sentence of the epoch
+		_epoch.timestamp_fraction = _sentence_timestamp_fraction;
+		_epoch.valid = false; //only the RMC of this epoch can make it valid, don't reuse the last fix
+	}
+	_epoch_mask |= sentence_mask;
+
+	switch (sentence_mask){
+	case EPOCH_HAS_RMC:
+		//always accept date from GPS - its RTC should be accurate enough without a fix
+		memcpy(&_epoch.date, &sentence->date, sizeof(struct minmea_date));
+		_epoch.valid = sentence->valid;
+		if (sentence->valid){
+			_epoch.latitude = sentence->latitude;
+			_epoch.longitude = sentence->longitude;
+			_epoch_fix.latitude_e7 = sentence->latitude_e7;
+			_epoch_fix.longitude_e7 = sentence->longitude_e7;
+			if ((_epoch_mask & EPOCH_HAS_VTG) == 0){
+				_epoch.azimuth = sentence->course;
+				_epoch_fix.course_centidegrees = sentence->course_centidegrees;
+				_epoch_fix.speed_mm_s = sentence->speed_mm_s;
+			}
+		}
+		break;
+	case EPOCH_HAS_VTG:
+		_epoch.azimuth = sentence->course;
+		_epoch.speed_kph = sentence->speed_kph;
+		_epoch_fix.course_centidegrees = sentence->course_centidegrees;
+		_epoch_fix.speed_mm_s = sentence->speed_mm_s;
+		break;
+	default:
+		break;
+	}
+
+	if ((_epoch_mask & EPOCH_COMPLETE) == EPOCH_COMPLETE){
+		epoch_publish();
+	}
+}
+
+static void epoch_publish(void){
+	seqlock_publish(&_published_lock, &_epoch);
+	_epoch_mask = 0;
+	if (_epoch.valid){
+		_epoch_fix.timestamp = _epoch.timestamp;
+		_epoch_fix.timestamp_fraction = _epoch.timestamp_fraction;
+		timebase_update(_epoch.timestamp, _epoch.timestamp_fraction, &_epoch.date, &_epoch.time);
+		dead_reckoning_gps(&_epoch_fix);
+		trip_summary_gps(&_epoch_fix);
+		geofence_evaluate(_epoch_fix.latitude_e7, _epoch_fix.longitude_e7);
+		log_time_sync();
+	}
+	if (_log_every_epoch){
+		log_gps();
+	}
+}
+
+bool gps_core_consume_binary(uint8_t c){
+	switch (_binary.state){
+	case binary_state_preamble1:
+		if (c == MTK_BINARY_PREAMBLE1){
+			_binary.state = binary_state_preamble2;
+			_binary.timestamp = _burst_timestamp;
+			_binary.timestamp_fraction = _burst_timestamp_fraction;
+		}
+		return false;
+	case binary_state_preamble2:
+		_binary.state = (c == MTK_BINARY_PREAMBLE2) ? binary_state_length : binary_state_preamble1;
+		return false;
+	case binary_state_length:
+		if (c != MTK_BINARY_PAYLOAD_LENGTH){
+			_binary.state = binary_state_preamble1;
+			return false;
+		}
+		_binary.ck_a = c;
+		_binary.ck_b = c;
+		_binary.index = 0;
+		_binary.state = binary_state_payload;
+		return false;
+	case binary_state_payload:
+		_binary.payload[_binary.index] = c;
+		_binary.index++;
+		_binary.ck_a += c;
+		_binary.ck_b += _binary.ck_a;
+		if (_binary.index == MTK_BINARY_PAYLOAD_LENGTH){
+			_binary.state = binary_state_ck_a;
+		}
+		return false;
+	case binary_state_ck_a:
+		_binary.state = (c == _binary.ck_a) ? binary_state_ck_b : binary_state_preamble1;
+		return false;
+	case binary_state_ck_b:
+		_binary.state = binary_state_preamble1;
+		if (likely(c == _binary.ck_b)){
+			binary_commit();
+			return true;
+		}
+		debugf("binary checksum error");
+		return false;
+	}
+	return false;
+}
+
+static void binary_commit(void){
+	//fixed layout - no text parsing, one packet carries the whole epoch
+	uint32_t date = binary_get_i32(22);
+	uint32_t time = binary_get_i32(26);
+	uint8_t fix_type = _binary.payload[21];
+
+	_epoch_mask = 0; //drop any partially received NMEA epoch
+	_epoch.timestamp = _binary.timestamp;
+	_epoch.timestamp_fraction = _binary.timestamp_fraction;
+
+	_epoch.date.day = date / 10000;
+	_epoch.date.month = (date / 100) % 100;
+	_epoch.date.year = date % 100;
+
+	_epoch.time.hours = time / 10000000;
+	_epoch.time.minutes = (time / 100000) % 100;
+	_epoch.time.seconds = (time / 1000) % 100;
+	_epoch.time.microseconds = (time % 1000) * 1000;
+
+	_epoch.valid = fix_type >= MTK_BINARY_FIX_2D;
+	if (_epoch.valid){
+		_epoch_fix.latitude_e7 = binary_get_i32(0);
+		_epoch_fix.longitude_e7 = binary_get_i32(4);
+		_epoch_fix.speed_mm_s = binary_get_i32(12) * 10;
+		_epoch_fix.course_centidegrees = binary_get_i32(16);
+		_epoch.latitude = binary_to_nmea_coordinate(_epoch_fix.latitude_e7);
+		_epoch.longitude = binary_to_nmea_coordinate(_epoch_fix.longitude_e7);
+		_epoch.speed_kph.value = binary_get_i32(12) * 36; //cm/s -> 1e-3 km/h
+		_epoch.speed_kph.scale = 1000;
+		_epoch.azimuth.value = _epoch_fix.course_centidegrees;
+		_epoch.azimuth.scale = 100;
+	}
+
+	epoch_publish();
+}
+
+static int32_t binary_get_i32(uint8_t offset){
+	const uint8_t *p = &_binary.payload[offset]; //may be unaligned
+	return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static minmea_float_t binary_to_nmea_coordinate(int32_t degrees_e7){
+	//frames keep the NMEA DDDMM.MMMMM layout, 1e-5 minute is ~2 cm
+	bool negative = degrees_e7 < 0;
+	uint32_t magnitude = negative ? -degrees_e7 : degrees_e7;
+	uint32_t degrees = magnitude / 10000000;
+	uint32_t minutes_e5 = (magnitude % 10000000) * 3 / 5; //*60 minutes, /100 to 1e-5
+	int32_t value = degrees * 10000000 + minutes_e5;
+	minmea_float_t f = { negative ? -value : value, 100000 };
+	return f;
+}
+
+void gps_core_get_current(frame_gps_t *target){
+	seqlock_read(&_published_lock, target);
+}
+
+void gps_core_invalidate(void){
+	_epoch.valid = false;
+	_epoch_mask = 0;
+	seqlock_publish(&_published_lock, &_epoch);
+}
+
+bool gps_core_is_valid(void){
+	return ((const frame_gps_t*)seqlock_peek(&_published_lock))->valid;
 }
 
 void gps_dump_state(void){
-    debugf("Lat %ld %ld", GLOBAL_frame_gps_current.latitude.value, GLOBAL_frame_gps_current.latitude.scale);
-    debugf("Lon %ld %ld", GLOBAL_frame_gps_current.longitude.value, GLOBAL_frame_gps_current.longitude.scale);
-    debugf("Az  %ld %ld", GLOBAL_frame_gps_current.azimuth.value, GLOBAL_frame_gps_current.azimuth.scale);
-    debugf("Speed  %ld %ld", GLOBAL_frame_gps_current.speed_kph.value, GLOBAL_frame_gps_current.speed_kph.scale);
-    debugf("Date %d:%d:%d Time %d:%d:%d", GLOBAL_frame_gps_current.date.year,
-         GLOBAL_frame_gps_current.date.month, GLOBAL_frame_gps_current.date.day,
-         GLOBAL_frame_gps_current.time.hours, GLOBAL_frame_gps_current.time.minutes,
-         GLOBAL_frame_gps_current.time.seconds);
-    debugf("timestamp %ld", GLOBAL_frame_gps_current.timestamp);
-    debugf("valid = %d", GLOBAL_frame_gps_current.valid);
+	frame_gps_t gps;
+	gps_core_get_current(&gps);
+    debugf("Lat %ld %ld", gps.latitude.value, gps.latitude.scale);
+    debugf("Lon %ld %ld", gps.longitude.value, gps.longitude.scale);
+    debugf("Az  %ld %ld", gps.azimuth.value, gps.azimuth.scale);
+    debugf("Speed  %ld %ld", gps.speed_kph.value, gps.speed_kph.scale);
+    debugf("Date %d:%d:%d Time %d:%d:%d", gps.date.year,
+         gps.date.month, gps.date.day,
+         gps.time.hours, gps.time.minutes,
+         gps.time.seconds);
+    debugf("timestamp %ld", gps.timestamp);
+    debugf("valid = %d", gps.valid);
+    debugf("NMEA checksum errors %ld", _parser.checksum_errors);
 }
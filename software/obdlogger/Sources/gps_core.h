@@ -1,11 +1,33 @@
 #ifndef GPS_CORE_H_
 #define GPS_CORE_H_
+#include <FreeRTOS/include/FreeRTOS.h>
 #include "logger_frames.h"
 #include <stdbool.h>
+#include <stdint.h>
 
-extern frame_gps_t GLOBAL_frame_gps_current;
+//fixed-point copy of a valid epoch, frame_gps_t keeps the NMEA representation for the log
+typedef struct {
+	TickType_t timestamp;
+	uint8_t timestamp_fraction;
+	uint16_t course_centidegrees;
+	int32_t latitude_e7; //1e-7 degrees
+	int32_t longitude_e7;
+	uint32_t speed_mm_s;
+} gps_fix_t;
 
-bool gps_core_consume_nmea(const char *line);
+//consistent copy of the most recent epoch, safe to call from any task
+void gps_core_get_current(frame_gps_t *target);
+bool gps_core_is_valid(void);
+void gps_core_invalidate(void); //receiver was put to sleep, its last fix is stale
+
+//returns true when a complete NMEA sentence with a correct checksum was parsed
+bool gps_core_consume_byte(char c);
+void gps_core_discard_sentence(void); //bytes of the current sentence were lost
+//returns true when a complete MTK binary packet with a correct checksum was parsed
+bool gps_core_consume_binary(uint8_t c);
+//called with the arrival time of the first byte after a quiet period
+void gps_core_burst_start(TickType_t ticks, uint8_t fraction);
+void gps_core_log_every_epoch(bool enable);
 void gps_dump_state(void);
 
 #endif
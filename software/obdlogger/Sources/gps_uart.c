@@ -22,8 +22,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "gps_uart.h"
 #include <misc.h>
 #include <MKE06Z4.h>
+#include <pins.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include "timestamp.h"
 
 #define DEBUG_ID DEBUG_ID_GPS_UART
 #include <debug.h>
@@ -36,25 +39,121 @@ static const UART_MemMapPtr _GPS_UART = UART0;
 /* ----------------------------------- */
 
 #define GPS_BAUD 9600U
-#define GPS_LINE_BUFFER_SIZE 100
+#define GPS_FAST_BAUD 38400U //RMC+GGA+VTG at 10 Hz need ~1900 bytes/s, more than 9600 baud can carry
+#define GPS_BAUD_PROBE_TIMEOUT_ms 3000 //no valid sentence for this long - try the other baud rate
+#define GPS_LOW_RATE_EPOCH_ms 5000 //see GPS_INIT_STRING
 
 typedef enum {
 	gps_state_none = 0,
 	gps_state_first_sentence_received = 1,
 	gps_state_initialized = 2,
+	gps_state_baud_switching = 3, //PMTK251 was sent, waiting for the first sentence at the new baud
+	gps_state_baud_change_pending = 4, //PMTK251 is queued, baud changes when it has been sent
 } gps_state_t;
 
 static const char GPS_INIT_STRING[] = "$PMTK300,5000,0,0,0,0*18\r\n"; //sets update rate to 5000ms
+static const char GPS_SENTENCE_FILTER_STRING[] = "$PMTK314,0,1,1,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0*29\r\n"; //RMC, VTG and GGA only
+static const char GPS_FAST_BAUD_STRING[] = "$PMTK251,38400*27\r\n";
+static const char GPS_RATE_5HZ_STRING[] = "$PMTK220,200*2C\r\n";
+static const char GPS_RATE_10HZ_STRING[] = "$PMTK220,100*2F\r\n";
+static const char GPS_BINARY_STRING[] = "$PGCMD,16,0,0,0,0,0*6A\r\n"; //MTK binary output, ignored by stock firmware
 static const char GPS_SLEEP_STRING[] = "$PMTK161,0*28\r\n";
+static const char GPS_PERIODIC_STRING[] = "$PMTK225,2,3000,12000,18000,72000*15\r\n"; //periodic standby, keeps ephemeris fresh
+static const char GPS_NORMAL_MODE_STRING[] = "$PMTK225,0*2B\r\n";
 static const char GPS_WAKE_STRING[] = "\r\n\r\n"; //anything will wake up the GPS module
 
-static volatile uint8_t _rx_ringbuffer[256];
-static volatile uint32_t _rx_ringbuffer_tail;
-static uint32_t _rx_ringbuffer_head;
-
-static const char *_tx_data_ptr;
+/* Received bytes are queued in a ring buffer that has to cover the longest
+ * SD card write of the storage task - 1 KB lasts ~1 s at 9600 baud and
+ * ~250 ms at 38400 baud. When it is full new bytes are dropped and counted.
+ *
+ * The ISR also records where every sentence ends. A sentence that lost bytes
+ * is marked as damaged, the task skips it up to its end without parsing
+ * instead of splicing it with the next one.
+ */
+#define GPS_RX_BUFFER_SIZE 1024 //must be a power of two
+static volatile uint8_t _rx_ringbuffer[GPS_RX_BUFFER_SIZE];
+static volatile uint32_t _rx_ringbuffer_tail; //free running, advanced by the ISR
+static volatile uint32_t _rx_ringbuffer_head; //free running, advanced by the task
+static volatile uint16_t _rx_lost_bytes; //saturating
+static volatile uint8_t _rx_overflows; //saturating, counts runs of lost bytes
+static bool _rx_sentence_damaged; //bytes of the sentence being received were lost
+
+#define GPS_SENTENCE_MARKS 16 //must be a power of two
+typedef struct {
+	uint32_t index; //ring buffer index just after the '\n'
+	bool damaged;
+} sentence_mark_t;
+static volatile sentence_mark_t _sentence_marks[GPS_SENTENCE_MARKS];
+static volatile uint32_t _sentence_marks_tail; //free running, advanced by the ISR
+static volatile uint32_t _sentence_marks_head;
+
+/* Transmission is queued in a ring buffer and never blocks the caller.
+ * PCB v0.2 sends it with the hardware UART transmit interrupt, PCB v0.1
+ * hands contiguous chunks of the ring to bitbang_uart.c.
+ */
+#define GPS_TX_BUFFER_SIZE 128 //must be a power of two, holds all configuration commands
+static uint8_t _tx_ringbuffer[GPS_TX_BUFFER_SIZE];
+static volatile uint32_t _tx_ringbuffer_tail; //free running, advanced by the task
+static volatile uint32_t _tx_ringbuffer_head; //free running, advanced by the ISR
+#if GPS_TX_BITBANG
+static volatile uint32_t _tx_bitbang_chunk; //bytes handed to bitbang_uart.c, 0 when idle
+static volatile uint32_t _tx_bitbang_pending_baud; //applied when the TX ring is empty, 0 - none
+#endif
+
+//arrival time of the first byte of every burst, recorded in the ISR
+#define GPS_BURST_GAP_ms 20 //receivers are quiet for much longer between epochs
+#define GPS_BURST_MARKS 4 //must be a power of two
+typedef struct {
+	uint32_t index; //ring buffer index of the first byte
+	TickType_t ticks;
+	uint8_t fraction;
+} burst_mark_t;
+static volatile burst_mark_t _burst_marks[GPS_BURST_MARKS];
+static volatile uint32_t _burst_marks_tail;
+static uint32_t _burst_marks_head;
+static TickType_t _last_rx_tick;
+
+static gps_state_t _state;
+static uint8_t _update_rate_hz; //0 = default low rate
+static uint32_t _baud = GPS_BAUD;
+static TickType_t _last_sentence_timestamp;
+static bool _binary_requested;
+static bool _binary_active; //module acknowledged the binary protocol by sending a valid packet
+
+/* Power policy - the receiver is put to standby (or periodic standby) when the
+ * vehicle has been stationary with the engine idle or off for a configured time,
+ * and woken when it moves. Time to first fix after every wake-up is measured
+ * and logged in the diagnostics frame, so the policy can be tuned.
+ */
+#define PID_ENGINE_RPM 0x0C
+#define PID_VEHICLE_SPEED 0x0D
+#define IDLE_RPM_MAX 1000
+#define VEHICLE_SAMPLE_MAX_AGE pdMS_TO_TICKS(60000) //older speed/RPM data can't tell if the vehicle moves
+#define TTFF_UNKNOWN 0xFFFF
+
+static TickType_t _standby_after_ticks; //0 = policy disabled
+static bool _standby_periodic;
+static bool _standby;
+static TickType_t _last_activity_timestamp;
+static TickType_t _last_vehicle_sample_timestamp;
+static bool _vehicle_sampled; //a speed or RPM sample has arrived
+static TickType_t _wake_timestamp;
+static bool _ttff_pending = true; //boot counts as a wake-up
+static uint16_t _last_ttff_s = TTFF_UNKNOWN;
 
 bool ringbuffer_getc(char *target);
+static void skip_damaged_sentence(void);
+static void uart_set_baud(uint32_t baud);
+static void gps_configure(void);
+static TickType_t gps_silence_timeout(void);
+static void gps_request_binary_output(void);
+static void gps_send(const char *command);
+static void tx_start(void);
+static void power_subtask(TickType_t now, bool sentence_received);
+static void gps_wake(void);
+#if GPS_TX_BITBANG
+static void tx_bitbang_complete_callback(void);
+#endif
 
 void gps_uart_init(void){
 	//SIM_PINSEL0 &= ~SIM_PINSEL_UART0PS_MASK; //UART0 is on PTB0 (RX) and PTB1 (TX)
@@ -67,18 +166,12 @@ void gps_uart_init(void){
 
 	_GPS_UART->C1 = 0; //no extra functions
 
+#if GPS_TX_BITBANG
 	_GPS_UART->C1 |= UART_C1_LOOPS_MASK | UART_C1_RSRC_MASK; //workaround for mismatched footprint
+#endif
 	_GPS_UART->C3 = 0;
 
-	//taken from Freescale demo driver
-	/* Calculate baud settings */
-	uint16_t u16Sbr = (((DEFAULT_BUS_CLOCK)>>4) + (GPS_BAUD>>1))/GPS_BAUD;
-
-	/* Save off the current value of the UARTx_BDH except for the SBR field */
-	uint8_t u8Temp = _GPS_UART->BDH & ~(UART_BDH_SBR_MASK);
-
-	_GPS_UART->BDH = u8Temp |  UART_BDH_SBR(u16Sbr >> 8);
-	_GPS_UART->BDL = (uint8_t)(u16Sbr & UART_BDL_SBR_MASK);
+	uart_set_baud(_baud);
 
 	_GPS_UART->C2 = UART_C2_TE_MASK /*enable transmitter*/
 			| UART_C2_RE_MASK /*enable receiver*/
@@ -89,13 +182,59 @@ void gps_uart_init(void){
 
 	taskEXIT_CRITICAL();
 
+#if GPS_TX_BITBANG
     bitbang_uart_init();
+#endif
+    _last_sentence_timestamp = xTaskGetTickCount();
+    _last_activity_timestamp = _last_sentence_timestamp;
+    _wake_timestamp = _last_sentence_timestamp;
 
 	debugf("GPS UART initialized");
 }
 
+void gps_uart_set_update_rate(uint8_t rate_hz){
+	if (rate_hz != 0 && rate_hz != 5 && rate_hz != 10){
+		debugf("Unsupported GPS rate %d Hz", rate_hz);
+		return;
+	}
+	_update_rate_hz = rate_hz;
+	gps_core_log_every_epoch(rate_hz != 0);
+}
+
+void gps_uart_request_binary(bool enable){
+	_binary_requested = enable;
+}
+
+static void uart_set_baud(uint32_t baud){
+	//taken from Freescale demo driver
+	/* Calculate baud settings */
+	uint16_t u16Sbr = (((DEFAULT_BUS_CLOCK)>>4) + (baud>>1))/baud;
+
+	/* Save off the current value of the UARTx_BDH except for the SBR field */
+	uint8_t u8Temp = _GPS_UART->BDH & ~(UART_BDH_SBR_MASK);
+
+	_GPS_UART->BDH = u8Temp |  UART_BDH_SBR(u16Sbr >> 8);
+	_GPS_UART->BDL = (uint8_t)(u16Sbr & UART_BDL_SBR_MASK);
+
+#if GPS_TX_BITBANG
+	//data queued before the change still goes out at the old rate, this can be called
+	//with interrupts masked, so the switch is left to the completion callback if TX is busy
+	taskENTER_CRITICAL();
+	if (_tx_bitbang_chunk == 0){
+		bitbang_uart_set_baud(baud);
+	} else {
+		_tx_bitbang_pending_baud = baud;
+	}
+	taskEXIT_CRITICAL();
+#endif
+	_baud = baud;
+}
+
 void gps_uart_deinit(void){
 	gps_uart_request_sleep(); //reduce power consumption to leave as much capacitance as possible for the SD card to flush
+	while (gps_uart_tx_idle() == false){
+		//wait until the sleep command has been sent
+	}
 
 	_GPS_UART->C2 = 0; //disable UART
 	NVIC_DisableIRQ(GPS_UART_IRQn);
@@ -104,75 +243,347 @@ void gps_uart_deinit(void){
 	SIM_SCGC &= ~GPS_UART_CLOCK_ENABLE_MASK; //disable clock to UART
 	taskEXIT_CRITICAL();
 
-	bitbang_uart_deinit(); //must be outside critical section - this will block until done
+#if GPS_TX_BITBANG
+	bitbang_uart_deinit();
+#endif
+}
+
+bool gps_uart_transmit(const char *data, uint32_t length){
+	uint32_t used = _tx_ringbuffer_tail - _tx_ringbuffer_head;
+	if (unlikely(length > GPS_TX_BUFFER_SIZE - used)){
+		return false;
+	}
+	uint32_t tail = _tx_ringbuffer_tail;
+	for (uint32_t i = 0; i < length; i++){
+		_tx_ringbuffer[(tail + i) & (GPS_TX_BUFFER_SIZE - 1)] = data[i];
+	}
+	__DMB(); //data must be in memory before the ISR can see it
+	_tx_ringbuffer_tail = tail + length;
+	tx_start();
+	return true;
+}
+
+bool gps_uart_tx_idle(void){
+	if (_tx_ringbuffer_tail != _tx_ringbuffer_head){
+		return false;
+	}
+#if GPS_TX_BITBANG
+	return _tx_bitbang_chunk == 0;
+#else
+	return (_GPS_UART->S1 & UART_S1_TC_MASK) != 0; //last stop bit is out
+#endif
+}
+
+static void gps_send(const char *command){
+	if (gps_uart_transmit(command, strlen(command)) == false){
+		debugf("GPS TX buffer full");
+	}
+}
+
+#if GPS_TX_BITBANG
+static void tx_start(void){
+	taskENTER_CRITICAL();
+	if (_tx_bitbang_chunk == 0){ //else the completion callback will continue
+		tx_bitbang_complete_callback();
+	}
+	taskEXIT_CRITICAL();
+}
+
+//called from the PIT ISR when a chunk was sent, and from tx_start to send the first one
+static void tx_bitbang_complete_callback(void){
+	_tx_ringbuffer_head += _tx_bitbang_chunk;
+	uint32_t pending = _tx_ringbuffer_tail - _tx_ringbuffer_head;
+	uint32_t index = _tx_ringbuffer_head & (GPS_TX_BUFFER_SIZE - 1);
+	uint32_t chunk = GPS_TX_BUFFER_SIZE - index; //up to the end of the ring
+	if (chunk > pending){
+		chunk = pending;
+	}
+	_tx_bitbang_chunk = chunk;
+	if (chunk){
+		bitbang_uart_transmit(chunk, &_tx_ringbuffer[index], tx_bitbang_complete_callback);
+	} else if (_tx_bitbang_pending_baud){
+		bitbang_uart_set_baud(_tx_bitbang_pending_baud);
+		_tx_bitbang_pending_baud = 0;
+	}
+}
+#else
+static void tx_start(void){
+	taskENTER_CRITICAL();
+	_GPS_UART->C2 |= UART_C2_TIE_MASK; //ISR sends everything up to the tail
+	taskEXIT_CRITICAL();
 }
+#endif
 
 void gps_uart_task(void){
-	static char line_buffer[GPS_LINE_BUFFER_SIZE];
-	static uint32_t line_buffer_index = 0;
 	char c = 0;
-	while (ringbuffer_getc(&c)){
-		if (unlikely(line_buffer_index > sizeof(line_buffer)-1)){ //overflow protection
-			line_buffer_index = 0;
-		}
-		line_buffer[line_buffer_index] = c;
-		line_buffer_index++;
-		if (c == '\n'){ //whole line has arrived - fire callback
-			line_buffer[line_buffer_index] = '\0';
-			if (likely(gps_core_consume_nmea(line_buffer))){ //NMEA sentence was correct
-				//disabled until next version of PCB - can't end data to the GPS
-				static bool _gps_initialized = false;
-				if (unlikely(_gps_initialized == false)){
-					debugf("Lowering GPS refresh rate");
-					_gps_initialized = true;
-					bitbang_uart_transmit(sizeof(GPS_INIT_STRING)-1, (const uint8_t*)GPS_INIT_STRING, NULL/*no callback*/);
-					//TODO: code for PCB v0.2 that uses hardware UART
-//					_tx_data_ptr = GPS_INIT_STRING;
-//					_GPS_UART->C2 |= UART_C2_TIE_MASK; //disable transmit interrupt
-				}
+	bool sentence_received = false;
+	while (1){
+		if (_burst_marks_head != _burst_marks_tail){
+			volatile burst_mark_t *mark = &_burst_marks[_burst_marks_head];
+			uint32_t ahead = mark->index - _rx_ringbuffer_head;
+			uint32_t unread = _rx_ringbuffer_tail - _rx_ringbuffer_head; //read after the mark
+			if (ahead == 0){
+				gps_core_burst_start(mark->ticks, mark->fraction);
+				_burst_marks_head = (_burst_marks_head + 1) % GPS_BURST_MARKS;
+			} else if (ahead > unread){ //mark queue overflowed, byte was already consumed
+				_burst_marks_head = (_burst_marks_head + 1) % GPS_BURST_MARKS;
+				continue;
+			}
+		}
+		if (_sentence_marks_head != _sentence_marks_tail){
+			skip_damaged_sentence();
+		}
+		if (ringbuffer_getc(&c) == false){
+			break;
+		}
+		//sentences are parsed as bytes arrive, no line buffering
+		if (unlikely(_binary_requested) && gps_core_consume_binary(c)){
+			if (unlikely(_binary_active == false)){
+				debugf("GPS uses binary protocol");
+				_binary_active = true;
 			}
-			line_buffer[line_buffer_index-2] = '\0';
-			debugf("<%s>", line_buffer);
+			sentence_received = true;
+		} else if (_binary_active == false && gps_core_consume_byte(c)){ //NMEA sentence was correct
+			sentence_received = true;
+		}
+	}
+
+	if (unlikely(_state == gps_state_baud_change_pending) && gps_uart_tx_idle()){
+		uart_set_baud(GPS_FAST_BAUD);
+		_state = gps_state_baud_switching;
+		_last_sentence_timestamp = xTaskGetTickCount();
+		return; //anything received so far was sent at the old baud
+	}
+
+	TickType_t now = xTaskGetTickCount();
+	power_subtask(now, sentence_received);
+	if (sentence_received){
+		_last_sentence_timestamp = now;
+		if (unlikely(_state != gps_state_initialized)){
+			gps_configure();
+		}
+	} else if (unlikely(now - _last_sentence_timestamp > gps_silence_timeout()) && _standby == false){
+		//the module may still run at the fast baud from before a reset (it has a backup supply)
+		//or may have ignored the baud change - try the other rate
+		_last_sentence_timestamp = now;
+		if (_binary_active){
+			debugf("No binary GPS data - falling back to NMEA");
+			_binary_active = false;
+		}
+		if (_state == gps_state_baud_switching){
+			debugf("GPS did not accept the baud rate change - using the default rate");
+			gps_uart_set_update_rate(0);
+		}
+		if (_state != gps_state_initialized){
+			_state = gps_state_none;
+			uart_set_baud(_baud == GPS_BAUD ? GPS_FAST_BAUD : GPS_BAUD);
+			debugf("No GPS data, trying %ld baud", _baud);
+		}
+	}
+}
 
-			line_buffer_index = 0;
-			continue;
-		} //end of if (c == '\n')
-	}//end of while (ringbuffer_getc(&c))
+void gps_uart_set_power_policy(uint16_t standby_after_minutes, bool periodic){
+	_standby_after_ticks = pdMS_TO_TICKS(60000) * (TickType_t)standby_after_minutes; //ms * tick rate overflows above ~357 minutes
+	_standby_periodic = periodic;
+}
+
+void gps_uart_vehicle_sample(const frame_pid_t *frame){
+	if (likely(_standby_after_ticks == 0) ||
+			(frame->frame_type != logger_frame_pid && frame->frame_type != logger_frame_pretrigger_pid) ||
+			frame->mode != pid_mode_01){
+		return;
+	}
+	bool active;
+	if (frame->pid == PID_VEHICLE_SPEED){
+		active = frame->a > 0;
+	} else if (frame->pid == PID_ENGINE_RPM){
+		active = (((uint32_t)frame->a << 8) | frame->b) / 4 > IDLE_RPM_MAX;
+	} else {
+		return;
+	}
+	_vehicle_sampled = true;
+	_last_vehicle_sample_timestamp = frame->timestamp;
+	if (active){
+		_last_activity_timestamp = frame->timestamp;
+		if (unlikely(_standby)){
+			gps_wake();
+		}
+	}
+}
+
+uint16_t gps_uart_get_last_ttff(void){
+	return _last_ttff_s;
+}
+
+static void power_subtask(TickType_t now, bool sentence_received){
+	if (unlikely(_ttff_pending) && sentence_received && gps_core_is_valid()){
+		_ttff_pending = false;
+		uint32_t ttff_s = (now - _wake_timestamp) / configTICK_RATE_HZ;
+		_last_ttff_s = ttff_s < TTFF_UNKNOWN ? ttff_s : TTFF_UNKNOWN - 1;
+		debugf("GPS time to first fix %ld s", ttff_s);
+	}
+
+	//the receiver only sleeps while speed/RPM samples can wake it up - never if neither PID
+	//is sampled, and it wakes when they stop arriving (eg. the channels were disabled)
+	bool vehicle_observed = _vehicle_sampled && now - _last_vehicle_sample_timestamp < VEHICLE_SAMPLE_MAX_AGE;
+	if (unlikely(_standby) && vehicle_observed == false){
+		debugf("No speed/RPM samples");
+		gps_wake();
+	} else if (_standby_after_ticks && _standby == false && _state == gps_state_initialized && vehicle_observed &&
+			(int32_t)(now - _last_activity_timestamp) > (int32_t)_standby_after_ticks){
+		debugf("Vehicle stationary - GPS standby");
+		gps_send(_standby_periodic ? GPS_PERIODIC_STRING : GPS_SLEEP_STRING);
+		gps_core_invalidate(); //don't log the last fix while the receiver sleeps
+		_standby = true;
+	}
+}
+
+static void gps_wake(void){
+	debugf("Vehicle moves - waking GPS up");
+	gps_send(GPS_WAKE_STRING);
+	if (_standby_periodic){
+		gps_send(GPS_NORMAL_MODE_STRING);
+	}
+	_standby = false;
+	_wake_timestamp = xTaskGetTickCount();
+	_last_sentence_timestamp = _wake_timestamp; //no baud probing while the receiver starts
+	_ttff_pending = true;
+}
+
+//at the default low rate a configured module sends one epoch per 5 s,
+//it is considered silent after two missed epochs
+static TickType_t gps_silence_timeout(void){
+	if (_state == gps_state_initialized && _update_rate_hz == 0){
+		return pdMS_TO_TICKS(2 * GPS_LOW_RATE_EPOCH_ms);
+	}
+	return pdMS_TO_TICKS(GPS_BAUD_PROBE_TIMEOUT_ms);
+}
+
+static void gps_configure(void){
+	switch (_state){
+	case gps_state_none:
+	case gps_state_first_sentence_received:
+		if (_update_rate_hz == 0){
+			debugf("Lowering GPS refresh rate");
+			gps_send(GPS_INIT_STRING);
+			gps_request_binary_output();
+			_state = gps_state_initialized;
+			break;
+		}
+		gps_send(GPS_SENTENCE_FILTER_STRING);
+		if (_baud != GPS_FAST_BAUD){
+			debugf("Raising GPS baud rate");
+			gps_send(GPS_FAST_BAUD_STRING);
+			_state = gps_state_baud_change_pending; //baud changes in gps_uart_task once PMTK251 is out
+			break;
+		}
+		//fall through - already running at the fast baud
+	case gps_state_baud_switching:
+		debugf("Raising GPS refresh rate to %d Hz", _update_rate_hz);
+		if (_update_rate_hz == 10){
+			gps_send(GPS_RATE_10HZ_STRING);
+		} else {
+			gps_send(GPS_RATE_5HZ_STRING);
+		}
+		gps_request_binary_output();
+		_state = gps_state_initialized;
+		break;
+	case gps_state_baud_change_pending:
+	case gps_state_initialized:
+		break;
+	}
+}
+
+static void gps_request_binary_output(void){
+	//modules with stock firmware ignore the command and keep sending NMEA,
+	//the binary parser is used only after the first valid packet arrives
+	if (_binary_requested){
+		debugf("Requesting binary GPS protocol");
+		gps_send(GPS_BINARY_STRING);
+	}
 }
 
 void gps_uart_request_sleep(void){
-	bitbang_uart_transmit(sizeof(GPS_SLEEP_STRING)-1, (const uint8_t*)GPS_SLEEP_STRING, NULL/*no callback*/);
+	gps_send(GPS_SLEEP_STRING);
 }
 
 void gps_uart_request_wake(void){
-	bitbang_uart_transmit(sizeof(GPS_WAKE_STRING)-1, (const uint8_t*)GPS_WAKE_STRING, NULL/*no callback*/);
+	gps_send(GPS_WAKE_STRING);
 }
 
 inline bool ringbuffer_getc(char *target){
-	if (_rx_ringbuffer_tail != _rx_ringbuffer_head){
-		*target = _rx_ringbuffer[_rx_ringbuffer_head];
-		_rx_ringbuffer_head = (_rx_ringbuffer_head + 1) % sizeof(_rx_ringbuffer);
+	uint32_t head = _rx_ringbuffer_head;
+	if (_rx_ringbuffer_tail != head){
+		*target = _rx_ringbuffer[head & (GPS_RX_BUFFER_SIZE - 1)];
+		_rx_ringbuffer_head = head + 1;
 		return true;
 	}
 	return false;
 }
 
+static void skip_damaged_sentence(void){
+	volatile sentence_mark_t *mark = &_sentence_marks[_sentence_marks_head & (GPS_SENTENCE_MARKS - 1)];
+	uint32_t ahead = mark->index - _rx_ringbuffer_head;
+	if (ahead == 0 || ahead > _rx_ringbuffer_tail - _rx_ringbuffer_head){ //sentence was read completely
+		_sentence_marks_head++;
+		return;
+	}
+	if (mark->damaged && _binary_active == false){
+		_rx_ringbuffer_head = mark->index; //binary packets are protected by their own checksum
+		_sentence_marks_head++;
+		gps_core_discard_sentence();
+	}
+}
+
+void gps_uart_get_rx_errors(uint8_t *overflows, uint16_t *lost_bytes){
+	*overflows = _rx_overflows;
+	*lost_bytes = _rx_lost_bytes;
+}
+
 extern void GPS_UART_IRQ_HANDLER(void);
 void GPS_UART_IRQ_HANDLER(void){
 	if (_GPS_UART->S1 & UART_S1_RDRF_MASK){ //new byte received
-		_rx_ringbuffer[_rx_ringbuffer_tail] = _GPS_UART->D;
-		_rx_ringbuffer_tail = (_rx_ringbuffer_tail + 1) % sizeof(_rx_ringbuffer);
-	} else if (unlikely(_tx_data_ptr)){
-		if (_GPS_UART->S1 & UART_S1_TDRE_MASK){ //transmit buffer empty
-			if (_tx_data_ptr){
-				if (*_tx_data_ptr){
-					_GPS_UART->D = *_tx_data_ptr;
-					_tx_data_ptr++;
-				} else { //end of string
-					_GPS_UART->C2 &= ~UART_C2_TIE_MASK; //disable transmit interrupt
-					_tx_data_ptr = NULL;
-				}
+		TickType_t now = xTaskGetTickCountFromISR();
+		if (now - _last_rx_tick >= pdMS_TO_TICKS(GPS_BURST_GAP_ms)){ //first byte of a new epoch
+			volatile burst_mark_t *mark = &_burst_marks[_burst_marks_tail];
+			mark->index = _rx_ringbuffer_tail;
+			timestamp_get_from_isr((TickType_t*)&mark->ticks, (uint8_t*)&mark->fraction);
+			_burst_marks_tail = (_burst_marks_tail + 1) % GPS_BURST_MARKS;
+		}
+		_last_rx_tick = now;
+		bool overrun = _GPS_UART->S1 & UART_S1_OR_MASK; //cleared by reading D
+		uint8_t c = _GPS_UART->D;
+		uint32_t tail = _rx_ringbuffer_tail;
+		bool full = tail - _rx_ringbuffer_head >= GPS_RX_BUFFER_SIZE;
+		if (unlikely(overrun || full)){
+			if (_rx_sentence_damaged == false && _rx_overflows < UINT8_MAX){
+				_rx_overflows++;
+			}
+			if (_rx_lost_bytes < UINT16_MAX){
+				_rx_lost_bytes++;
+			}
+			_rx_sentence_damaged = true;
+		}
+		if (likely(full == false)){
+			_rx_ringbuffer[tail & (GPS_RX_BUFFER_SIZE - 1)] = c;
+			_rx_ringbuffer_tail = tail + 1;
+			if (c == '\n' && _sentence_marks_tail - _sentence_marks_head < GPS_SENTENCE_MARKS){
+				volatile sentence_mark_t *mark = &_sentence_marks[_sentence_marks_tail & (GPS_SENTENCE_MARKS - 1)];
+				mark->index = tail + 1;
+				mark->damaged = _rx_sentence_damaged;
+				_sentence_marks_tail++;
+				_rx_sentence_damaged = false;
 			}
 		}
 	}
+#if !GPS_TX_BITBANG
+	if ((_GPS_UART->C2 & UART_C2_TIE_MASK) && (_GPS_UART->S1 & UART_S1_TDRE_MASK)){ //transmit buffer empty
+		if (_tx_ringbuffer_head != _tx_ringbuffer_tail){
+			_GPS_UART->D = _tx_ringbuffer[_tx_ringbuffer_head & (GPS_TX_BUFFER_SIZE - 1)];
+			_tx_ringbuffer_head++;
+		} else { //everything sent
+			_GPS_UART->C2 &= ~UART_C2_TIE_MASK; //disable transmit interrupt
+		}
+	}
+#endif
 }
@@ -1,10 +1,28 @@
 #ifndef SOURCES_GPS_UART_H_
 #define SOURCES_GPS_UART_H_
+#include <stdbool.h>
+#include <stdint.h>
+#include "logger_frames.h"
 
 void gps_uart_init(void);
 void gps_uart_deinit(void);
 void gps_uart_task(void);
 
+//0 = default (one fix per 5 s), 5 or 10 Hz raise the baud rate and log every epoch
+void gps_uart_set_update_rate(uint8_t rate_hz);
+//asks the module for MTK binary output, NMEA is used until a valid binary packet arrives
+void gps_uart_request_binary(bool enable);
+
+//standby_after_minutes 0 disables the policy, periodic uses PMTK225 periodic standby instead of standby
+void gps_uart_set_power_policy(uint16_t standby_after_minutes, bool periodic);
+void gps_uart_vehicle_sample(const frame_pid_t *frame); //speed and RPM samples drive the power policy
+uint16_t gps_uart_get_last_ttff(void); //seconds, 0xFFFF until the first fix
+void gps_uart_get_rx_errors(uint8_t *overflows, uint16_t *lost_bytes); //since boot, can be called from any task
+
+//non-blocking, returns false if the data doesn't fit into the transmit buffer
+bool gps_uart_transmit(const char *data, uint32_t length);
+bool gps_uart_tx_idle(void); //everything including the last stop bit has been sent
+
 void gps_uart_request_sleep(void);
 void gps_uart_request_wake(void);
 
@@ -0,0 +1,153 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "log_recovery.h"
+#include <misc.h>
+#include <stddef.h>
+#include <string.h>
+
+#define DEBUG_ID DEBUG_ID_STORAGE_TASK
+#include <debug.h>
+
+/* Recovery of a log file that was not closed normally.
+ *
+ * The end of the data is found by scanning backward from the end of the
+ * file, so it takes the same time on a multi-megabyte file. The file may end
+ * with a partially written frame, erased bytes of the power fail reserve or
+ * stale data of a previous file in the last cluster, so a frame is accepted
+ * only if its start flag, length, type and checksum are correct and the frame
+ * before it ends exactly where it starts. Frames are then walked backward
+ * the same way to find the last GPS frame.
+ */
+
+#define FRAME_START 0xCA
+#define FRAME_OVERHEAD 3 //start, length and checksum bytes
+#define MIN_FRAME_LENGTH 5 //timestamp and type
+#define MAX_FRAME_LENGTH 64
+#define MAX_FRAME_TYPE logger_frame_power_fail
+#define SCAN_WINDOW (MAX_FRAME_LENGTH + FRAME_OVERHEAD)
+#define MAX_SCAN_BYTES (128 * 1024UL) //power fail reserve and a partial frame are much shorter
+#define MAX_GPS_SEARCH_FRAMES 4096
+
+static bool read_at(FIL *file, FSIZE_t offset, uint8_t *target, uint32_t length);
+static bool frame_valid_at(FIL *file, FSIZE_t offset, FSIZE_t end, uint8_t *length);
+static bool previous_frame(FIL *file, FSIZE_t offset, FSIZE_t *previous);
+
+bool log_recovery_truncate(FIL *file, frame_gps_t *last_gps){
+	memset(last_gps, 0, sizeof(*last_gps));
+
+	//find the last frame that is preceded by a valid frame
+	FSIZE_t size = f_size(file);
+	FSIZE_t scan_end = size > MAX_SCAN_BYTES ? size - MAX_SCAN_BYTES : 0;
+	uint8_t window[SCAN_WINDOW];
+	bool found = false;
+	FSIZE_t last_frame = 0;
+	uint8_t last_length = 0;
+	for (FSIZE_t window_end = size; window_end > scan_end && found == false; ){
+		FSIZE_t window_start = window_end > scan_end + SCAN_WINDOW ? window_end - SCAN_WINDOW : scan_end;
+		if (read_at(file, window_start, window, window_end - window_start) == false){
+			return false;
+		}
+		for (int32_t i = window_end - window_start - 1; i >= 0; i--){
+			FSIZE_t candidate = window_start + i;
+			FSIZE_t previous;
+			if (window[i] == FRAME_START && frame_valid_at(file, candidate, size, &last_length) &&
+					(candidate == 0 || previous_frame(file, candidate, &previous))){
+				last_frame = candidate;
+				found = true;
+				break;
+			}
+		}
+		window_end = window_start;
+	}
+	if (found == false){
+		debugf("recovery: no valid frame in %ld bytes", size);
+		return false;
+	}
+
+	FSIZE_t data_end = last_frame + last_length + FRAME_OVERHEAD;
+	debugf("recovery: %ld of %ld bytes are valid", data_end, size);
+	f_lseek(file, data_end);
+	f_truncate(file);
+
+	//walk frames backward to the last GPS frame
+	FSIZE_t frame = last_frame;
+	for (uint32_t i = 0; i < MAX_GPS_SEARCH_FRAMES; i++){
+		uint8_t length;
+		if (read_at(file, frame + 1, &length, 1) && length == sizeof(frame_gps_t)){
+			uint8_t type;
+			read_at(file, frame + 2 + offsetof(frame_gps_t, frame_type), &type, 1);
+			if (type == logger_frame_gps){
+				read_at(file, frame + 2, (uint8_t*)last_gps, sizeof(frame_gps_t));
+				break;
+			}
+		}
+		if (frame == 0 || previous_frame(file, frame, &frame) == false){
+			break;
+		}
+	}
+	return true;
+}
+
+static bool read_at(FIL *file, FSIZE_t offset, uint8_t *target, uint32_t length){
+	UINT bytes_read = 0;
+	return f_lseek(file, offset) == FR_OK && f_read(file, target, length, &bytes_read) == FR_OK && bytes_read == length;
+}
+
+static bool frame_valid_at(FIL *file, FSIZE_t offset, FSIZE_t end, uint8_t *length){
+	uint8_t frame[SCAN_WINDOW];
+	if (read_at(file, offset, frame, 2) == false){
+		return false;
+	}
+	uint8_t data_length = frame[1];
+	if (frame[0] != FRAME_START || data_length < MIN_FRAME_LENGTH || data_length > MAX_FRAME_LENGTH ||
+			offset + data_length + FRAME_OVERHEAD > end){
+		return false;
+	}
+	if (read_at(file, offset + 2, frame + 2, data_length + 1) == false){
+		return false;
+	}
+	uint8_t type = frame[2 + offsetof(frame_pid_t, frame_type)];
+	if (type == logger_frame_disabled || type > MAX_FRAME_TYPE){
+		return false;
+	}
+	uint8_t checksum = 0;
+	for (uint32_t i = 0; i < data_length; i++){
+		checksum += frame[2 + i];
+	}
+	*length = data_length;
+	return checksum == frame[2 + data_length];
+}
+
+//finds the valid frame that ends exactly at offset
+static bool previous_frame(FIL *file, FSIZE_t offset, FSIZE_t *previous){
+	uint8_t window[SCAN_WINDOW];
+	FSIZE_t window_start = offset > SCAN_WINDOW ? offset - SCAN_WINDOW : 0;
+	uint32_t window_length = offset - window_start;
+	if (read_at(file, window_start, window, window_length) == false){
+		return false;
+	}
+	for (uint32_t i = 0; i + MIN_FRAME_LENGTH + FRAME_OVERHEAD <= window_length; i++){
+		uint8_t length;
+		if (window[i] == FRAME_START && window[i + 1] + FRAME_OVERHEAD == window_length - i &&
+				frame_valid_at(file, window_start + i, offset, &length)){
+			*previous = window_start + i;
+			return true;
+		}
+	}
+	return false;
+}
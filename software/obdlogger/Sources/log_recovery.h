@@ -0,0 +1,11 @@
+#ifndef SOURCES_LOG_RECOVERY_H_
+#define SOURCES_LOG_RECOVERY_H_
+#include <FatFS/ff.h>
+#include "logger_frames.h"
+#include <stdbool.h>
+
+//file must be open for reading and writing, it is truncated after the last valid frame
+//returns false if there is no valid frame, last_gps->valid is false if no GPS frame was found
+bool log_recovery_truncate(FIL *file, frame_gps_t *last_gps);
+
+#endif /* SOURCES_LOG_RECOVERY_H_ */
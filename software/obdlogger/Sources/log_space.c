@@ -0,0 +1,352 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "file_paths.h"
+#include "log_space.h"
+#include <misc.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DEBUG_ID DEBUG_ID_STORAGE_TASK
+#include <debug.h>
+
+/* Oldest-first deletion of logs when the card fills up.
+ *
+ * Free space is taken from the free cluster count of FatFS. It is computed by a
+ * single FAT scan at boot (or read from FSINFO) and kept up to date by FatFS
+ * when clusters are allocated or freed, so checking it costs nothing.
+ *
+ * LOG_INDEX_PATH lists every log file in the order they were named, so the
+ * oldest ones are found without walking the directory tree. Only the first few
+ * live records are cached in RAM, logs are deleted from the cache at runtime
+ * (no file handle needed) and flagged in the index the next time the log file
+ * is closed and its handle can be borrowed. A log deleted but not flagged
+ * before a power loss is flagged at the next boot, f_unlink finds no file.
+ */
+
+#define LOG_SPACE_DEFAULT_RESERVE_MB 32
+#define OLDEST_CACHE_SIZE 4
+#define NO_RECORD 0xFFFFFFFF
+
+typedef struct {
+	uint32_t offset; //in LOG_INDEX_PATH
+	log_index_record_t record;
+} cached_log_t;
+
+static FATFS *_fs;
+static uint32_t _reserve_kb = LOG_SPACE_DEFAULT_RESERVE_MB * 1024;
+static cached_log_t _oldest[OLDEST_CACHE_SIZE]; //oldest live logs, in index order
+static uint8_t _oldest_count;
+static uint8_t _evicted_count; //first cached logs already deleted, not yet flagged in the index
+static uint32_t _scan_offset; //index offset after the last cached record
+static uint32_t _open_offset = NO_RECORD; //record of the open log, it and later ones are never cached
+static uint32_t _closed_size = NO_RECORD;
+
+static void index_rebuild(FIL *index);
+static void index_fix_last_size(FIL *index);
+static void index_write_pending(FIL *index);
+static void index_append(FIL *index, const log_index_record_t *log);
+static void cache_refill(FIL *index);
+static bool record_from_name(const char *name, log_index_record_t *log);
+static bool parse_digits(const char *text, uint32_t count, uint32_t *value);
+static bool free_space_is_known(void);
+static uint32_t free_space_kb(void);
+
+void log_space_init(FATFS *fs, FIL *scratch){
+	_fs = fs;
+
+	//the only full FAT scan (if FSINFO is not valid), FatFS keeps the count up to date afterwards
+	DWORD free_clusters;
+	FATFS *fs_ptr;
+	FRESULT r = f_getfree("", &free_clusters, &fs_ptr);
+	debugf("free clusters %ld %d", free_clusters, r);
+
+	r = f_open(scratch, LOG_INDEX_PATH, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+	if (r == FR_NO_FILE){
+		r = f_open(scratch, LOG_INDEX_PATH, FA_CREATE_NEW | FA_READ | FA_WRITE);
+		if (r == FR_OK){
+			index_rebuild(scratch);
+		}
+	} else if (r == FR_OK){
+		index_fix_last_size(scratch);
+	}
+	if (r != FR_OK){
+		debugf("log index open %d", r);
+		return;
+	}
+
+	//make room before logging starts, more logs can be deleted than fit in the cache
+	cache_refill(scratch);
+	while (_oldest_count){
+		log_space_task();
+		if (_evicted_count == 0){
+			break; //enough space
+		}
+		index_write_pending(scratch);
+		cache_refill(scratch);
+	}
+	f_close(scratch);
+	debugf("free %ld kB, reserve %ld kB", free_space_kb(), _reserve_kb);
+}
+
+void log_space_add(FIL *scratch, const log_index_record_t *log, bool opened){
+	FRESULT r = f_open(scratch, LOG_INDEX_PATH, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
+	if (r != FR_OK){
+		debugf("log index open %d", r);
+		return;
+	}
+	index_write_pending(scratch);
+	uint32_t offset = f_size(scratch);
+	index_append(scratch, log);
+	if (opened){
+		_open_offset = offset;
+	}
+	cache_refill(scratch);
+	f_close(scratch);
+}
+
+void log_space_closed(uint32_t size){
+	_closed_size = size;
+}
+
+void log_space_task(void){
+	while (_evicted_count < _oldest_count && free_space_is_known() && free_space_kb() < _reserve_kb){
+		const log_index_record_t *log = &_oldest[_evicted_count].record;
+		char path[32];
+		log_space_path(path, sizeof(path), log);
+		FRESULT r = f_unlink(path);
+		debugf("deleted %s %d, free %ld kB", path, r, free_space_kb());
+		if (r != FR_OK && r != FR_NO_FILE){
+			return; //card error, try again later
+		}
+		_evicted_count++;
+
+		if (r == FR_OK && (log->flags & LOG_INDEX_FLAG_RECOVERED) == 0){
+			//remove the month and year directories, only succeeds when they are empty
+			snprintf(path, sizeof(path), "obdlog/%02d/%02d", log->year, log->month);
+			if (f_unlink(path) == FR_OK){
+				snprintf(path, sizeof(path), "obdlog/%02d", log->year);
+				f_unlink(path);
+			}
+		}
+	}
+}
+
+void log_space_set_reserve(uint32_t reserve_mb){
+	_reserve_kb = reserve_mb * 1024;
+}
+
+void log_space_path(char *path, uint32_t path_size, const log_index_record_t *log){
+	if (log->flags & LOG_INDEX_FLAG_RECOVERED){
+		snprintf(path, path_size, RECOVERED_LOG_PATH_FORMAT, (int)log->sequence);
+		return;
+	}
+	int length = snprintf(path, path_size, "obdlog/%02d/%02d/%02d%02d%02d%02d",
+			log->year,
+			log->month,
+			log->day,
+			log->hours,
+			log->minutes,
+			log->seconds);
+	if (log->sequence){
+		snprintf(path + length, path_size - length, ".%03d", (int)log->sequence);
+	} else {
+		snprintf(path + length, path_size - length, ".log");
+	}
+}
+
+static void index_rebuild(FIL *index){
+	//the index is missing - the existing logs are listed once, in directory order
+	DIR root_dir, year_dir, month_dir;
+	FILINFO info;
+	log_index_record_t log;
+	char path[16];
+	uint32_t count = 0;
+
+	if (f_opendir(&root_dir, "obdlog") != FR_OK){
+		return;
+	}
+	while (f_readdir(&root_dir, &info) == FR_OK && info.fname[0]){
+		if ((info.fattrib & AM_DIR) == 0){
+			if (record_from_name(info.fname, &log)){ //recovered logs
+				log.size = info.fsize;
+				index_append(index, &log);
+				count++;
+			}
+			continue;
+		}
+
+		uint32_t year;
+		if (info.fname[2] != '\0' || parse_digits(info.fname, 2, &year) == false){
+			continue; //not a year directory
+		}
+		snprintf(path, sizeof(path), "obdlog/%02d", (int)year);
+		if (f_opendir(&year_dir, path) != FR_OK){
+			continue;
+		}
+		while (f_readdir(&year_dir, &info) == FR_OK && info.fname[0]){
+			uint32_t month;
+			if ((info.fattrib & AM_DIR) == 0 || info.fname[2] != '\0' ||
+					parse_digits(info.fname, 2, &month) == false){
+				continue;
+			}
+			snprintf(path, sizeof(path), "obdlog/%02d/%02d", (int)year, (int)month);
+			if (f_opendir(&month_dir, path) != FR_OK){
+				continue;
+			}
+			while (f_readdir(&month_dir, &info) == FR_OK && info.fname[0]){
+				if (record_from_name(info.fname, &log) && (log.flags & LOG_INDEX_FLAG_RECOVERED) == 0){
+					log.year = year;
+					log.month = month;
+					log.size = info.fsize;
+					index_append(index, &log);
+					count++;
+				}
+			}
+			f_closedir(&month_dir);
+		}
+		f_closedir(&year_dir);
+	}
+	f_closedir(&root_dir);
+	f_sync(index);
+	debugf("log index rebuilt, %ld logs", count);
+}
+
+static void index_fix_last_size(FIL *index){
+	//the log open during the previous session may have been cut by a power loss
+	if (f_size(index) < sizeof(log_index_record_t)){
+		return;
+	}
+	uint32_t offset = f_size(index) - sizeof(log_index_record_t);
+	log_index_record_t log;
+	UINT bytes_read = 0;
+	f_lseek(index, offset);
+	if (f_read(index, &log, sizeof(log), &bytes_read) != FR_OK || bytes_read != sizeof(log) ||
+			(log.flags & LOG_INDEX_FLAG_DELETED)){
+		return;
+	}
+
+	char path[32];
+	FILINFO info;
+	log_space_path(path, sizeof(path), &log);
+	FRESULT r = f_stat(path, &info);
+	if (r == FR_OK){
+		log.size = info.fsize;
+	} else if (r == FR_NO_FILE){
+		log.flags |= LOG_INDEX_FLAG_DELETED;
+	} else {
+		return;
+	}
+	UINT bytes_written = 0;
+	f_lseek(index, offset);
+	f_write(index, &log, sizeof(log), &bytes_written);
+}
+
+static void index_write_pending(FIL *index){
+	UINT bytes_written = 0;
+	for (uint32_t i = 0; i < _evicted_count; i++){
+		uint8_t flags = _oldest[i].record.flags | LOG_INDEX_FLAG_DELETED;
+		f_lseek(index, _oldest[i].offset + offsetof(log_index_record_t, flags));
+		f_write(index, &flags, sizeof(flags), &bytes_written);
+	}
+
+	if (_closed_size != NO_RECORD && _open_offset != NO_RECORD){
+		f_lseek(index, _open_offset + offsetof(log_index_record_t, size));
+		f_write(index, &_closed_size, sizeof(_closed_size), &bytes_written);
+	}
+	_closed_size = NO_RECORD;
+}
+
+static void index_append(FIL *index, const log_index_record_t *log){
+	UINT bytes_written = 0;
+	f_lseek(index, f_size(index));
+	f_write(index, log, sizeof(*log), &bytes_written);
+}
+
+static void cache_refill(FIL *index){
+	//drop the deleted logs, keep the rest
+	_oldest_count -= _evicted_count;
+	memmove(_oldest, _oldest + _evicted_count, _oldest_count * sizeof(_oldest[0]));
+	_evicted_count = 0;
+
+	uint32_t end = _open_offset != NO_RECORD ? _open_offset : f_size(index);
+	f_lseek(index, _scan_offset);
+	while (_oldest_count < OLDEST_CACHE_SIZE && _scan_offset < end){
+		cached_log_t *entry = &_oldest[_oldest_count];
+		UINT bytes_read = 0;
+		if (f_read(index, &entry->record, sizeof(entry->record), &bytes_read) != FR_OK ||
+				bytes_read != sizeof(entry->record)){
+			break;
+		}
+		entry->offset = _scan_offset;
+		_scan_offset += sizeof(entry->record);
+		if ((entry->record.flags & LOG_INDEX_FLAG_DELETED) == 0){
+			_oldest_count++;
+		}
+	}
+}
+
+//parses "DDHHMMSS.LOG", "DDHHMMSS.001" and "REC00001.LOG" (8.3 names are upper case)
+static bool record_from_name(const char *name, log_index_record_t *log){
+	uint32_t day, hours, minutes, seconds, sequence;
+	memset(log, 0, sizeof(*log));
+	if (strlen(name) != 12 || name[8] != '.'){
+		return false;
+	}
+	if (memcmp(name, "REC", 3) == 0 && parse_digits(name + 3, 5, &sequence) && memcmp(name + 9, "LOG", 3) == 0){
+		log->flags = LOG_INDEX_FLAG_RECOVERED;
+		log->sequence = sequence;
+		return true;
+	}
+	if (parse_digits(name, 2, &day) == false ||
+			parse_digits(name + 2, 2, &hours) == false ||
+			parse_digits(name + 4, 2, &minutes) == false ||
+			parse_digits(name + 6, 2, &seconds) == false){
+		return false;
+	}
+	if (memcmp(name + 9, "LOG", 3) == 0){
+		sequence = 0;
+	} else if (parse_digits(name + 9, 3, &sequence) == false){
+		return false;
+	}
+	log->day = day;
+	log->hours = hours;
+	log->minutes = minutes;
+	log->seconds = seconds;
+	log->sequence = sequence;
+	return true;
+}
+
+static bool parse_digits(const char *text, uint32_t count, uint32_t *value){
+	*value = 0;
+	for (uint32_t i = 0; i < count; i++){
+		if (text[i] < '0' || text[i] > '9'){
+			return false;
+		}
+		*value = *value * 10 + (text[i] - '0');
+	}
+	return true;
+}
+
+static bool free_space_is_known(void){
+	return _fs && _fs->free_clst <= _fs->n_fatent - 2;
+}
+
+static uint32_t free_space_kb(void){
+	return (_fs->free_clst * _fs->csize) >> 1; //512 byte sectors, fits up to 2 TB cards
+}
@@ -0,0 +1,32 @@
+#ifndef SOURCES_LOG_SPACE_H_
+#define SOURCES_LOG_SPACE_H_
+#include <FatFS/ff.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOG_INDEX_FLAG_DELETED 0x01
+#define LOG_INDEX_FLAG_RECOVERED 0x02 //obdlog/recNNNNN.log, the date is not known
+
+//one record of LOG_INDEX_PATH per log file, in the order the files were named
+typedef struct {
+	uint8_t year; //GPS time at the start of the trip
+	uint8_t month;
+	uint8_t day;
+	uint8_t hours;
+	uint8_t minutes;
+	uint8_t seconds;
+	uint8_t flags;
+	uint8_t reserved1;
+	uint32_t sequence; //segment number, or the recovered log number
+	uint32_t size; //bytes, updated when the log is closed or at the next boot
+} log_index_record_t;
+
+//Functions to be called only from the storage task, scratch is used while the log file is closed
+void log_space_init(FATFS *fs, FIL *scratch); //after mount, before the log file is opened
+void log_space_add(FIL *scratch, const log_index_record_t *log, bool opened); //opened - it is the new log file
+void log_space_closed(uint32_t size); //size of the closed log file, written with the next record
+void log_space_task(void); //deletes the oldest logs when free space drops below the reserve
+void log_space_set_reserve(uint32_t reserve_mb);
+void log_space_path(char *path, uint32_t path_size, const log_index_record_t *log);
+
+#endif /* SOURCES_LOG_SPACE_H_ */
@@ -16,61 +16,163 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "adc.h"
+#include "dead_reckoning.h"
 #include "diagnostics.h"
 #include "file_paths.h"
 #include "gps_core.h"
+#include "gps_uart.h"
 #include "led.h"
 #include "logger_core.h"
 #include "logger_frames.h"
 #include <FreeRTOS/include/queue.h>
 #include <misc.h>
+#include <obd/obd_pids.h>
 #include "power.h"
 #include <stdbool.h>
 #include <string.h>
+#include "timebase.h"
+#include "timestamp.h"
+#include "trip_summary.h"
 
 #define DEBUG_ID DEBUG_ID_LOGGER_CORE
 #include <debug.h>
 
 #define QUEUE_LENGTH_PIDS 50
-#define WRITE_CHUNK_SIZE 512
+#define WRITE_CHUNK_SIZE 512 //one sector, chunks are written at sector boundaries of the file
+#define MAX_ENCODED_FRAME_LENGTH (64 + 3) //longest frame with start, length and checksum bytes
+#define PRETRIGGER_BUFFER_LENGTH 64 //in PID frames
+#define MAX_AGGREGATE_CHANNELS 16
+#define MAX_DEADBAND_CHANNELS 16
 
 /* --------- public data ---------------- */
 
 /* --------- private data --------------- */
 static QueueHandle_t _pid_queue_handle;
 static volatile bool _log_gps_request = true; //this can be modified from another task
+static volatile bool _log_time_sync_request; //this can be modified from another task
 static volatile bool _log_acceleration_request; //this can be modified from another task
 static volatile bool _log_diagostics_request = true; //this can be modified from another task
 static volatile bool _log_battery_voltage_request; //this can be modified from another task
-static uint8_t _write_chunk_buffer[WRITE_CHUNK_SIZE];
+static uint8_t _write_chunk_buffer[WRITE_CHUNK_SIZE + MAX_ENCODED_FRAME_LENGTH];
 static uint32_t _write_chunk_index;
+static uint8_t _log_write_errors; //saturating
+static uint32_t _log_bytes_written; //since boot
 static FIL *_log_file_handle_ptr;
 
+//PID samples not written to the log, kept in case a trigger fires
+static frame_pid_t _pretrigger_buffer[PRETRIGGER_BUFFER_LENGTH];
+static uint32_t _pretrigger_head; //next frame is written here
+static uint32_t _pretrigger_count;
+static TickType_t _pretrigger_window_ticks;
+
+//PIDs that are written as one min/max/mean frame per window instead of every sample
+typedef struct {
+	pid_mode_t mode;
+	uint8_t pid;
+	uint16_t count;
+	uint16_t min;
+	uint16_t max;
+	uint16_t last;
+	uint32_t sum;
+	TickType_t window_ticks;
+	TickType_t window_start;
+} aggregate_state_t;
+
+static aggregate_state_t _aggregate[MAX_AGGREGATE_CHANNELS];
+static uint32_t _aggregate_count;
+
+//PIDs that are logged only when the value changes by more than the tolerance
+typedef struct {
+	pid_mode_t mode;
+	uint8_t pid;
+	bool has_value;
+	uint16_t tolerance;
+	uint16_t last_value;
+	TickType_t keyframe_ticks;
+	TickType_t last_logged_timestamp;
+} deadband_state_t;
+
+static deadband_state_t _deadband[MAX_DEADBAND_CHANNELS];
+static uint32_t _deadband_count;
+
 /* --------- private prototypes --------- */
 static void log_frame(uint8_t frame_length, const uint8_t *frame_ptr);
+static void log_write(uint32_t length);
 static void log_gps_INTERNAL(void);
+static void log_time_sync_INTERNAL(void);
 static void log_diagnostics_INTERNAL(void);
 static void log_battery_voltage_INTERNAL(void);
+static void log_pid_queue_frame(logger_frame_type_t type, pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+static bool log_pid_queue_frame_try(logger_frame_type_t type, pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+static void log_geofence_event(TickType_t timestamp, uint8_t fence_index, bool entered, uint8_t profile);
+static void pretrigger_store(const frame_pid_t *frame);
+static void pretrigger_flush(const frame_pid_t *trigger_frame);
+static bool aggregate_consume(const frame_pid_t *frame);
+static void aggregate_close(aggregate_state_t *a, TickType_t timestamp);
+static bool deadband_suppress(const frame_pid_t *frame);
 
 /* ----------- implementation ----------- */
 
 //log_pid can be called from another task
 void log_pid(pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d){
+	log_pid_queue_frame(logger_frame_pid, mode, pid, a, b, c, d);
+}
+
+//sample is logged only if a trigger fires shortly after it
+void log_pid_pretrigger(pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d){
+	log_pid_queue_frame(logger_frame_pretrigger_pid, mode, pid, a, b, c, d);
+}
+
+//trigger frames travel through the PID queue to keep the order with buffered samples
+void log_trigger(uint8_t trigger_index, pid_mode_t mode, uint8_t pid, uint16_t value){
+	log_pid_queue_frame(logger_frame_trigger, mode, pid, trigger_index, value >> 8, value & 0xFF, 0);
+}
+
+//the diagnostics frame has a single writer (acquisition task), so only PID samples and triggers
+//count a full queue there
+static void log_pid_queue_frame(logger_frame_type_t type, pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d){
+	if (unlikely(log_pid_queue_frame_try(type, mode, pid, a, b, c, d) == false)){
+		GLOBAL_diagnostics_frame.pid_queue_blocks++;
+		diagnostics_publish();
+	}
+}
+
+static bool log_pid_queue_frame_try(logger_frame_type_t type, pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d){
 	frame_pid_t frame;
 	memset(&frame, 0, sizeof(frame));
-	frame.frame_type = logger_frame_pid;
+	frame.frame_type = type;
 	frame.mode = mode;
 	frame.pid = pid;
 	frame.a = a;
 	frame.b = b;
 	frame.c = c;
 	frame.d = d;
-	frame.timestamp = xTaskGetTickCount();
-	if (unlikely(xQueueSendToBack(_pid_queue_handle, &frame, 0/*don't wait if queue is full*/)) == errQUEUE_FULL){
-		GLOBAL_diagnostics_frame.pid_queue_blocks++;
+	timestamp_get(&frame.timestamp, &frame.timestamp_fraction);
+	return xQueueSendToBack(_pid_queue_handle, &frame, 0/*don't wait if queue is full*/) != errQUEUE_FULL;
+}
+
+//called from the storage task, which also drains the queue
+void log_geofence(uint8_t fence_index, bool entered, uint8_t profile){
+	//sent through the PID queue like triggers, so events stay in order with samples
+	if (unlikely(log_pid_queue_frame_try(logger_frame_geofence, 0, 0, fence_index, entered, profile, 0) == false)){
+		//queue is full - write the event directly, ahead of the queued samples, rather than lose it
+		TickType_t timestamp;
+		uint8_t timestamp_fraction;
+		timestamp_get(&timestamp, &timestamp_fraction);
+		log_geofence_event(timestamp, fence_index, entered, profile);
 	}
 }
 
+static void log_geofence_event(TickType_t timestamp, uint8_t fence_index, bool entered, uint8_t profile){
+	frame_geofence_t event;
+	event.timestamp = timestamp;
+	event.frame_type = logger_frame_geofence;
+	event.fence_index = fence_index;
+	event.entered = entered;
+	event.profile = profile;
+	log_frame(sizeof(event), (const uint8_t*)&event);
+}
+
 void log_detected_protocol(obd_protocol_t protocol){
 	static bool logged_once = false;
 	if (logged_once == false){
@@ -81,6 +183,7 @@ void log_detected_protocol(obd_protocol_t protocol){
 		frame.a = protocol;
 		if (unlikely(xQueueSendToBack(_pid_queue_handle, &frame, 0/*don't wait if queue is full*/)) == errQUEUE_FULL){
 			GLOBAL_diagnostics_frame.pid_queue_blocks++;
+			diagnostics_publish();
 		}
 		logged_once = true;
 	}
@@ -90,6 +193,10 @@ void log_gps(void){
 	_log_gps_request = true;
 }
 
+void log_time_sync(void){
+	_log_time_sync_request = true;
+}
+
 void log_acceleration(void){
 	_log_acceleration_request = true;
 }
@@ -119,6 +226,14 @@ uint32_t log_task(void){
 	frame_pid_t frame;
 	uint32_t saved_frames_counter = 0;
 	while (xQueueReceive(_pid_queue_handle, &frame, 0/*don't wait*/) == pdTRUE){
+		frame_position_t position;
+		//these see every PID sample, also ones suppressed below or only kept for a trigger
+		if (unlikely(dead_reckoning_speed(&frame, &position))){
+			log_frame(sizeof(position), (const uint8_t*)&position);
+		}
+		gps_uart_vehicle_sample(&frame);
+		trip_summary_pid(&frame);
+
 
 		if (unlikely(frame.frame_type == logger_frame_save_used_protocol)){
 
@@ -140,6 +255,16 @@ uint32_t log_task(void){
 				debugf("Could not open detected protocol file");
 			}
 
+		} else if (frame.frame_type == logger_frame_pretrigger_pid){
+			pretrigger_store(&frame);
+		} else if (unlikely(frame.frame_type == logger_frame_trigger)){
+			pretrigger_flush(&frame);
+		} else if (unlikely(frame.frame_type == logger_frame_geofence)){
+			log_geofence_event(frame.timestamp, frame.a, frame.b, frame.c);
+		} else if (_aggregate_count && aggregate_consume(&frame)){
+			//sample was added to its aggregation window
+		} else if (_deadband_count && deadband_suppress(&frame)){
+			//value didn't change - not logged
 		} else { //normal frame to log
 			//			debugf("Got frame to log");
 			log_frame(sizeof(frame), (const uint8_t*)&frame);
@@ -152,6 +277,11 @@ uint32_t log_task(void){
 		log_gps_INTERNAL();
 	}
 
+	if (unlikely(_log_time_sync_request)){
+		_log_time_sync_request = false;
+		log_time_sync_INTERNAL();
+	}
+
 	if (unlikely(_log_diagostics_request)){
 		_log_diagostics_request = false;
 		log_diagnostics_INTERNAL();
@@ -165,11 +295,7 @@ uint32_t log_task(void){
 }
 
 static void log_frame(uint8_t frame_length, const uint8_t *frame_ptr){
-	//buffer data to be written to minimize SPI IO operations
-	if (_write_chunk_index + frame_length + 3/*start,length,checksum bytes*/ >= sizeof(_write_chunk_buffer)){
-		log_flush(); //this function rewinds _write_chunk_index
-	}
-
+	//the buffer always has room for one more frame, it is written out below
 	_write_chunk_buffer[_write_chunk_index] = 0xCA; //start of frame flag
 	_write_chunk_index++;
 	_write_chunk_buffer[_write_chunk_index] = frame_length;
@@ -186,28 +312,70 @@ static void log_frame(uint8_t frame_length, const uint8_t *frame_ptr){
 
 	_write_chunk_buffer[_write_chunk_index] = checksum;
 	_write_chunk_index++;
+
+	/* Write up to the next sector boundary of the file, frames may be split between
+	 * chunks. After a partial flush this realigns the file, from then on every chunk is
+	 * one whole sector that FatFS writes directly from this buffer, without copying it
+	 * to the file buffer or rewriting a partially filled sector.
+	 */
+	uint32_t sector_room = WRITE_CHUNK_SIZE - f_tell(_log_file_handle_ptr) % WRITE_CHUNK_SIZE;
+	if (_write_chunk_index >= sector_room){
+		log_write(sector_room);
+		_write_chunk_index -= sector_room;
+		memmove(_write_chunk_buffer, _write_chunk_buffer + sector_room, _write_chunk_index);
+	}
 }
 
 void log_flush(void){
-	uint32_t bytes_written = 0;
-	f_write(_log_file_handle_ptr, _write_chunk_buffer, _write_chunk_index, &bytes_written);
-	debugf("Written %ld bytes, buffer had %ld", bytes_written, _write_chunk_index);
+	log_write(_write_chunk_index);
 	_write_chunk_index = 0;
+}
+
+static void log_write(uint32_t length){
+	uint32_t bytes_written = 0;
+	f_write(_log_file_handle_ptr, _write_chunk_buffer, length, &bytes_written);
+	debugf("Written %ld bytes, buffer had %ld", bytes_written, length);
+	_log_bytes_written += bytes_written;
+	if (unlikely(bytes_written != length) && _log_write_errors < UINT8_MAX){
+		_log_write_errors++; //the data is lost, the space manager makes room for the next write
+	}
 	if (GLOBAL_power_failure_flag == false){
 		led_blink_request(LED_SD_CARD);
 	}
 }
 
+uint32_t log_get_bytes_written(void){
+	return _log_bytes_written;
+}
+
+void log_power_fail(const frame_power_fail_t *frame){
+	log_frame(sizeof(*frame), (const uint8_t*)frame);
+}
+
 static void log_gps_INTERNAL(void){
-	if (GLOBAL_frame_gps_current.valid == false){
+	frame_gps_t frame;
+	gps_core_get_current(&frame);
+	if (frame.valid == false){
 		return; //don't log invalid frames
 	}
-	log_frame(sizeof(GLOBAL_frame_gps_current), (const uint8_t*)&GLOBAL_frame_gps_current);
+	log_frame(sizeof(frame), (const uint8_t*)&frame);
+}
+
+static void log_time_sync_INTERNAL(void){
+	frame_time_sync_t frame;
+	timebase_fill_sync_frame(&frame);
+	log_frame(sizeof(frame), (const uint8_t*)&frame);
 }
 
 static void log_diagnostics_INTERNAL(void){
-	GLOBAL_diagnostics_frame.timestamp = xTaskGetTickCount();
-	log_frame(sizeof(GLOBAL_diagnostics_frame), (const uint8_t*)&GLOBAL_diagnostics_frame);
+	frame_diagnostics_t frame;
+	diagnostics_get(&frame);
+	frame.timestamp = xTaskGetTickCount();
+	frame.gps_ttff_s = gps_uart_get_last_ttff(); //owned by the storage task, not published with the rest
+	gps_uart_get_rx_errors(&frame.gps_rx_overflows, &frame.gps_rx_lost_bytes);
+	frame.log_write_errors = _log_write_errors;
+	frame.reserved1 = 0;
+	log_frame(sizeof(frame), (const uint8_t*)&frame);
 }
 
 static void log_battery_voltage_INTERNAL(void){
@@ -220,3 +388,193 @@ static void log_battery_voltage_INTERNAL(void){
 
 	log_frame(sizeof(frame), (const uint8_t*)&frame);
 }
+
+void log_pretrigger_window_extend(TickType_t window_ticks){
+	if (window_ticks > _pretrigger_window_ticks){
+		_pretrigger_window_ticks = window_ticks;
+	}
+}
+
+void log_pretrigger_window_fit(uint32_t samples_per_1000s){
+	if (samples_per_1000s == 0){
+		return;
+	}
+	TickType_t window_max = PRETRIGGER_BUFFER_LENGTH * 1000 * configTICK_RATE_HZ / samples_per_1000s;
+	if (_pretrigger_window_ticks > window_max){
+		debugf("Pre-trigger window %ld ticks doesn't fit in %d samples, shortened to %ld ticks",
+				(uint32_t)_pretrigger_window_ticks, PRETRIGGER_BUFFER_LENGTH, (uint32_t)window_max);
+		_pretrigger_window_ticks = window_max;
+	}
+}
+
+static void pretrigger_store(const frame_pid_t *frame){
+	if (_pretrigger_window_ticks == 0){
+		return; //no triggers configured
+	}
+	memcpy(&_pretrigger_buffer[_pretrigger_head], frame, sizeof(frame_pid_t));
+	_pretrigger_buffer[_pretrigger_head].frame_type = logger_frame_pid;
+	_pretrigger_head = (_pretrigger_head + 1) % PRETRIGGER_BUFFER_LENGTH;
+	if (_pretrigger_count < PRETRIGGER_BUFFER_LENGTH){
+		_pretrigger_count++;
+	} //else the oldest sample was overwritten
+}
+
+static void pretrigger_flush(const frame_pid_t *trigger_frame){
+	frame_trigger_t frame;
+	memset(&frame, 0, sizeof(frame));
+
+	//write buffered samples from the pre-trigger window, oldest first
+	uint32_t index = (_pretrigger_head + PRETRIGGER_BUFFER_LENGTH - _pretrigger_count) % PRETRIGGER_BUFFER_LENGTH;
+	for (uint32_t i = 0; i < _pretrigger_count; i++){
+		const frame_pid_t *f = &_pretrigger_buffer[index];
+		if (trigger_frame->timestamp - f->timestamp <= _pretrigger_window_ticks){
+			log_frame(sizeof(frame_pid_t), (const uint8_t*)f);
+			frame.pretrigger_frames++;
+		}
+		index = (index + 1) % PRETRIGGER_BUFFER_LENGTH;
+	}
+	_pretrigger_count = 0;
+
+	frame.frame_type = logger_frame_trigger;
+	frame.timestamp = trigger_frame->timestamp;
+	frame.trigger_index = trigger_frame->a;
+	frame.mode = trigger_frame->mode;
+	frame.pid = trigger_frame->pid;
+	frame.value = trigger_frame->b << 8 | trigger_frame->c;
+	debugf("Trigger %d, %d pre-trigger frames", frame.trigger_index, frame.pretrigger_frames);
+	log_frame(sizeof(frame), (const uint8_t*)&frame);
+}
+
+void log_aggregate_configure(pid_mode_t mode, uint8_t pid, TickType_t window_ticks){
+	if (_aggregate_count >= MAX_AGGREGATE_CHANNELS || window_ticks == 0){
+		debugf("Can't aggregate PID %02X", pid);
+		return;
+	}
+	aggregate_state_t *a = &_aggregate[_aggregate_count];
+	memset(a, 0, sizeof(aggregate_state_t));
+	a->mode = mode;
+	a->pid = pid;
+	a->window_ticks = window_ticks;
+	_aggregate_count++;
+	debugf("PID %02X aggregated every %ld ticks", pid, (uint32_t)window_ticks);
+}
+
+void log_aggregate_close_all(void){
+	TickType_t now = xTaskGetTickCount();
+	for (uint32_t i = 0; i < _aggregate_count; i++){
+		if (_aggregate[i].count){
+			aggregate_close(&_aggregate[i], now);
+		}
+	}
+}
+
+static bool aggregate_consume(const frame_pid_t *frame){
+	if (frame->frame_type != logger_frame_pid){
+		return false;
+	}
+
+	aggregate_state_t *a = NULL;
+	for (uint32_t i = 0; i < _aggregate_count; i++){
+		if (_aggregate[i].mode == frame->mode && _aggregate[i].pid == frame->pid){
+			a = &_aggregate[i];
+			break;
+		}
+	}
+	if (a == NULL){
+		return false; //PID is logged sample by sample
+	}
+
+	//same raw value as used by triggers - byte A or bytes A and B
+	uint16_t value = frame->a;
+	if (obd_pid_get_length(frame->mode, frame->pid) != 1){
+		value = frame->a << 8 | frame->b;
+	}
+
+	if (a->count == 0){
+		a->window_start = frame->timestamp;
+		a->min = value;
+		a->max = value;
+		a->sum = 0;
+	}
+	if (value < a->min){
+		a->min = value;
+	}
+	if (value > a->max){
+		a->max = value;
+	}
+	a->sum += value;
+	a->last = value;
+	a->count++;
+
+	if (frame->timestamp - a->window_start >= a->window_ticks || a->count == UINT16_MAX){
+		aggregate_close(a, frame->timestamp);
+	}
+	return true;
+}
+
+static void aggregate_close(aggregate_state_t *a, TickType_t timestamp){
+	frame_aggregate_t frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.frame_type = logger_frame_aggregate;
+	frame.timestamp = timestamp;
+	frame.mode = a->mode;
+	frame.pid = a->pid;
+	frame.count = a->count;
+	frame.min = a->min;
+	frame.max = a->max;
+	frame.mean = a->sum / a->count;
+	frame.last = a->last;
+	log_frame(sizeof(frame), (const uint8_t*)&frame);
+	a->count = 0;
+}
+
+void log_deadband_configure(pid_mode_t mode, uint8_t pid, uint16_t tolerance, TickType_t keyframe_ticks){
+	if (_deadband_count >= MAX_DEADBAND_CHANNELS){
+		debugf("Can't add deadband to PID %02X", pid);
+		return;
+	}
+	deadband_state_t *d = &_deadband[_deadband_count];
+	memset(d, 0, sizeof(deadband_state_t));
+	d->mode = mode;
+	d->pid = pid;
+	d->tolerance = tolerance;
+	d->keyframe_ticks = keyframe_ticks;
+	_deadband_count++;
+	debugf("PID %02X deadband %d keyframe %ld ticks", pid, tolerance, (uint32_t)keyframe_ticks);
+}
+
+static bool deadband_suppress(const frame_pid_t *frame){
+	if (frame->frame_type != logger_frame_pid){
+		return false;
+	}
+
+	deadband_state_t *d = NULL;
+	for (uint32_t i = 0; i < _deadband_count; i++){
+		if (_deadband[i].mode == frame->mode && _deadband[i].pid == frame->pid){
+			d = &_deadband[i];
+			break;
+		}
+	}
+	if (d == NULL){
+		return false;
+	}
+
+	//same raw value as used by triggers - byte A or bytes A and B
+	uint16_t value = frame->a;
+	if (obd_pid_get_length(frame->mode, frame->pid) != 1){
+		value = frame->a << 8 | frame->b;
+	}
+
+	if (d->has_value){
+		uint16_t delta = value > d->last_value ? value - d->last_value : d->last_value - value;
+		bool keyframe_due = d->keyframe_ticks && frame->timestamp - d->last_logged_timestamp >= d->keyframe_ticks;
+		if (delta <= d->tolerance && keyframe_due == false){
+			return true;
+		}
+	}
+
+	d->has_value = true;
+	d->last_value = value;
+	d->last_logged_timestamp = frame->timestamp;
+	return false;
+}
@@ -4,20 +4,33 @@
 #include <FatFS/ff.h>
 #include "logger_frames.h"
 #include <obd/obd.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 //Functions that can be safely called from any task
 void log_pid(pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d);
 void log_gps(void);
+void log_time_sync(void); //logs the most recent tick/UTC pair of the timebase
 void log_acceleration(void);
 void log_internal_diagnostics(void);
 void log_battery_voltage(void);
 void log_detected_protocol(obd_protocol_t protocol);
+void log_pid_pretrigger(pid_mode_t mode, uint8_t pid, uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+void log_trigger(uint8_t trigger_index, pid_mode_t mode, uint8_t pid, uint16_t value);
 
 
 //Functions to be called only from a single task
 void log_init(FIL *file_handle_ptr);
 uint32_t log_task(void); //returns the number of frames saved
 void log_flush(void);
+uint32_t log_get_bytes_written(void); //payload bytes handed to FatFS since boot
+void log_power_fail(const frame_power_fail_t *frame);
+void log_geofence(uint8_t fence_index, bool entered, uint8_t profile); //writes directly if the queue is full
+void log_pretrigger_window_extend(TickType_t window_ticks); //call before acquisition is started
+//shortens the window to what the pre-trigger ring holds at this rate of pre-trigger samples
+void log_pretrigger_window_fit(uint32_t samples_per_1000s); //call before acquisition is started
+void log_aggregate_configure(pid_mode_t mode, uint8_t pid, TickType_t window_ticks); //call before acquisition is started
+void log_aggregate_close_all(void); //writes partially filled aggregation windows
+void log_deadband_configure(pid_mode_t mode, uint8_t pid, uint16_t tolerance, TickType_t keyframe_ticks); //call before acquisition is started
 
 #endif /* SOURCES_LOGGER_CORE_H_ */
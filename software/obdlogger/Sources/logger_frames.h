@@ -14,6 +14,13 @@ typedef enum {
 	logger_frame_internal_diagnostics = 4,
 	logger_frame_save_used_protocol = 5,
 	logger_frame_battery_voltage = 6,
+	logger_frame_trigger = 7,
+	logger_frame_aggregate = 8,
+	logger_frame_time_sync = 9,
+	logger_frame_position = 10,
+	logger_frame_geofence = 11,
+	logger_frame_power_fail = 12,
+	logger_frame_pretrigger_pid = 0x80, //internal - PID frame goes only to the pre-trigger buffer
 } logger_frame_type_t;
 
 typedef enum {
@@ -34,7 +41,7 @@ typedef struct {
 	uint8_t b;
 	uint8_t c;
 	uint8_t d;
-	uint8_t reserved1;
+	uint8_t timestamp_fraction; //elapsed part of the timestamp tick in 1/256 units
 } frame_pid_t;
 
 typedef struct {
@@ -45,9 +52,11 @@ typedef struct {
 	uint16_t logging_task_stack_free_minimum;
 	const uint16_t timebase_hz;
 	uint8_t pid_get_failures;
+	uint8_t gps_rx_overflows; //GPS receive buffer overflows since boot, saturating
+	uint16_t gps_ttff_s; //time to first fix after the last GPS wake-up, 0xFFFF until known
+	uint16_t gps_rx_lost_bytes; //since boot, saturating
+	uint8_t log_write_errors; //incomplete log writes (card full or failing) since boot, saturating
 	uint8_t reserved1;
-	uint8_t reserved2;
-	uint8_t reserved3;
 } frame_diagnostics_t;
 
 typedef struct { //optimally packed :)
@@ -64,11 +73,59 @@ typedef struct { //optimally packed :)
 
 	bool valid;
 
-	uint8_t reserved1;
+	uint8_t timestamp_fraction; //elapsed part of the timestamp tick in 1/256 units
 	uint8_t reserved2;
 	uint8_t reserved3;
 } frame_gps_t;
 
+#define TIME_SYNC_FLAG_PPS 0x01 //timestamp was captured by the PPS line (not present on current PCBs)
+#define TIME_SYNC_FLAG_DRIFT_VALID 0x02 //drift_ppb was measured over a long enough span
+
+typedef struct {
+	TickType_t timestamp; //tick at which the GPS epoch started
+	logger_frame_type_t frame_type; //always logger_frame_time_sync
+	uint8_t timestamp_fraction; //elapsed part of the timestamp tick in 1/256 units
+	uint8_t flags; //TIME_SYNC_FLAG_xxx
+	uint8_t reserved1;
+	uint32_t utc_seconds; //Unix time of the epoch
+	uint32_t utc_microseconds;
+	int32_t drift_ppb; //tick rate error, positive when ticks run fast
+} frame_time_sync_t;
+
+typedef struct {
+	TickType_t timestamp; //time of the vehicle speed sample
+	logger_frame_type_t frame_type; //always logger_frame_position
+	uint8_t timestamp_fraction; //elapsed part of the timestamp tick in 1/256 units
+	uint8_t speed_kph; //OBD vehicle speed
+	uint8_t reserved1;
+	int32_t latitude; //1e-7 degrees
+	int32_t longitude; //1e-7 degrees
+	uint16_t accuracy_dm; //estimated standard deviation
+	uint16_t course_centidegrees; //last reliable GPS course
+} frame_position_t;
+
+typedef struct {
+	TickType_t timestamp;
+	logger_frame_type_t frame_type; //always logger_frame_geofence
+	uint8_t fence_index; //order in the config file
+	uint8_t entered; //1 - entered, 0 - left
+	uint8_t profile; //profile of the fence
+} frame_geofence_t;
+
+#define POWER_FAIL_FLAG_PREVIOUS_BOOT 0x01 //stats of the session before this boot
+#define POWER_FAIL_FLAG_RESERVE_EXHAUSTED 0x02 //a flush had to allocate clusters
+
+typedef struct {
+	TickType_t timestamp;
+	logger_frame_type_t frame_type; //always logger_frame_power_fail
+	uint8_t flags;
+	uint8_t flush_count; //emergency flushes in the session, saturating
+	uint8_t reserved1;
+	uint32_t duration_us; //of the slowest emergency flush
+	uint16_t voltage_start_adc_code; //supply voltage when that flush started
+	uint16_t voltage_end_adc_code; //and when it was committed
+} frame_power_fail_t;
+
 typedef struct {
 	TickType_t timestamp;
 	logger_frame_type_t frame_type; //always logger_frame_battery_voltage
@@ -76,6 +133,31 @@ typedef struct {
 	uint16_t battery_voltage_adc_code;
 } frame_battery_voltage_t;
 
+typedef struct {
+	TickType_t timestamp;
+	logger_frame_type_t frame_type; //always logger_frame_trigger
+	uint8_t trigger_index;
+	pid_mode_t mode;
+	uint8_t pid;
+	uint16_t value; //raw PID value that fired the trigger
+	uint16_t pretrigger_frames; //number of buffered PID frames written just before this frame
+} frame_trigger_t;
+
+typedef struct {
+	TickType_t timestamp; //end of the aggregation window
+	logger_frame_type_t frame_type; //always logger_frame_aggregate
+	pid_mode_t mode;
+	uint8_t pid;
+	uint8_t reserved1;
+	//values are raw PID values like in triggers - byte A of single byte PIDs, A*256+B otherwise
+	uint16_t count; //number of samples in the window
+	uint16_t min;
+	uint16_t max;
+	uint16_t mean;
+	uint16_t last;
+	uint16_t reserved2;
+} frame_aggregate_t;
+
 //https://github.com/stanleyhuangyc/ArduinoOBD/blob/master/libraries/OBD/OBD.h
 #define PID_ENGINE_LOAD 0x04
 #define PID_COOLANT_TEMP 0x05
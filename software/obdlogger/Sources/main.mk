@@ -14,7 +14,6 @@ SOURCES := \
     led.c \
     logger_core.c \
     main.c \
-    minmea.c \
     obd/obd.c \
     obd/obd_can.c \
     obd/obd_k_line.c \
@@ -23,7 +22,17 @@ SOURCES := \
     watchdog.c \
     rtt_console.c \
     gps_core.c \
+    nmea_parser.c \
     storage_task.c \
+    timestamp.c \
+    timebase.c \
+    seqlock.c \
+    dead_reckoning.c \
+    geofence.c \
+    powerfail.c \
+    log_recovery.c \
+    log_space.c \
+    trip_summary.c \
     ../Project_Settings/Startup_Code/startup_MKE06Z4.S \
     ../Project_Settings/Startup_Code/system_MKE06Z4.c \
     ../../common/FatFS/diskio.c \
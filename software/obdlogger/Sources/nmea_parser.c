@@ -0,0 +1,309 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "nmea_parser.h"
+#include <misc.h>
+#include <string.h>
+
+/* Allocation-free NMEA parser for the Cortex-M0+, which has no divide instruction.
+ *
+ * Sentences are parsed byte by byte as they arrive, nothing is buffered.
+ * Numeric fields are accumulated digit by digit, so coordinates, speed and
+ * course come out pre-scaled to fixed point using multiplications only:
+ * DDDMM.MMMM is split by keeping the last two integer digits apart and
+ * the division of minutes by 60 (and the other unit changes) is a multiply
+ * by a Q32 reciprocal.
+ *
+ * Has no RTOS dependencies, so it builds on a host as well (see nmea_benchmark).
+ */
+
+#define SENTENCE_ID(a, b, c) ((uint32_t)(a) << 16 | (uint32_t)(b) << 8 | (uint32_t)(c))
+#define SENTENCE_RMC SENTENCE_ID('R', 'M', 'C')
+#define SENTENCE_GGA SENTENCE_ID('G', 'G', 'A')
+#define SENTENCE_VTG SENTENCE_ID('V', 'T', 'G')
+
+#define MAX_FIELD_VALUE 100000000 //further digits are dropped to avoid overflow
+#define MAX_INTEGER_HEAD 1000000
+#define MAX_FRACTION_DIGITS 7
+#define MAX_SPEED 65535 //km/h or knots, keeps the 64-bit products in range
+
+//rounded up, so exact multiples are not truncated to one less
+#define RECIPROCAL_60_Q32 71582789ULL //2^32 / 60
+#define RECIPROCAL_1E5_Q32 42950ULL //2^32 / 100000
+#define KPH_E7_TO_MM_S_Q32 119305ULL //2^32 * 1000000 / 3600 / 1e7
+#define KNOTS_E7_TO_MM_S_Q32 220953ULL //2^32 * 1852000 / 3600 / 1e7
+
+typedef enum {
+	nmea_state_idle = 0, //waiting for '$'
+	nmea_state_fields,
+	nmea_state_checksum_high,
+	nmea_state_checksum_low,
+	nmea_state_end, //waiting for '\n'
+} nmea_state_t;
+
+static const uint32_t FRACTION_WEIGHT_E7[MAX_FRACTION_DIGITS] = {
+		1000000, 100000, 10000, 1000, 100, 10, 1,
+};
+
+static void field_char(nmea_parser_t *parser, char c);
+static void field_end(nmea_parser_t *parser);
+static void field_reset(nmea_parser_t *parser);
+static int32_t field_coordinate_e7(const nmea_parser_t *parser);
+static uint32_t field_speed_mm_s(const nmea_parser_t *parser, uint64_t factor_q32);
+static uint16_t field_centidegrees(const nmea_parser_t *parser);
+static uint8_t hex_value(char c);
+
+bool nmea_parser_consume(nmea_parser_t *parser, char c){
+	switch (parser->state){
+	case nmea_state_idle:
+		break;
+	case nmea_state_fields:
+		if (c == '*'){
+			field_end(parser);
+			parser->state = nmea_state_checksum_high;
+			return false;
+		}
+		if (unlikely(c < ' ' || c > '~')){ //broken sentence
+			parser->state = nmea_state_idle;
+			break;
+		}
+		parser->checksum ^= c;
+		if (c == ','){
+			field_end(parser);
+		} else {
+			field_char(parser, c);
+		}
+		return false;
+	case nmea_state_checksum_high:
+		parser->received_checksum = hex_value(c) << 4;
+		parser->state = nmea_state_checksum_low;
+		return false;
+	case nmea_state_checksum_low:
+		parser->received_checksum |= hex_value(c);
+		parser->state = nmea_state_end;
+		return false;
+	case nmea_state_end:
+		if (c == '\r'){
+			return false;
+		}
+		parser->state = nmea_state_idle;
+		if (c == '\n'){
+			if (likely(parser->checksum == parser->received_checksum)){
+				switch (parser->id){
+				case SENTENCE_RMC: parser->sentence.id = nmea_sentence_rmc; break;
+				case SENTENCE_GGA: parser->sentence.id = nmea_sentence_gga; break;
+				case SENTENCE_VTG: parser->sentence.id = nmea_sentence_vtg; break;
+				default: parser->sentence.id = nmea_sentence_other; break;
+				}
+				return true;
+			}
+			parser->checksum_errors++;
+		}
+		break;
+	}
+
+	if (c == '$'){ //start of a new sentence, also resynchronizes after errors
+		parser->state = nmea_state_fields;
+		parser->checksum = 0;
+		parser->field_index = 0;
+		parser->id = 0;
+		field_reset(parser);
+		memset(&parser->sentence, 0, sizeof(parser->sentence));
+	}
+	return false;
+}
+
+void nmea_parser_reset(nmea_parser_t *parser){
+	parser->state = nmea_state_idle;
+}
+
+static void field_char(nmea_parser_t *parser, char c){
+	nmea_sentence_t *sentence = &parser->sentence;
+	uint8_t i = parser->char_index;
+	parser->char_index++;
+
+	if (i == 0){
+		parser->first_char = c;
+	}
+
+	if (parser->field_index == 0){ //address field, eg. "GPRMC" - keep the last three characters
+		parser->id = (parser->id << 8 | (uint8_t)c) & 0xFFFFFF;
+		return;
+	}
+
+	if (c >= '0' && c <= '9'){
+		uint8_t digit = c - '0';
+		if (parser->value < MAX_FIELD_VALUE){
+			parser->value = parser->value * 10 + digit;
+			if (parser->scale){
+				parser->scale *= 10;
+			}
+		}
+
+		if (parser->scale){ //fractional digit
+			if (parser->fraction_digits < MAX_FRACTION_DIGITS){
+				parser->fraction_e7 += digit * FRACTION_WEIGHT_E7[parser->fraction_digits];
+				parser->fraction_digits++;
+			}
+		} else if (parser->integer_head < MAX_INTEGER_HEAD){
+			parser->integer_head = parser->integer_head * 10 + parser->integer_tens;
+			parser->integer_tens = parser->integer_ones;
+			parser->integer_ones = digit;
+		}
+
+		//time (hhmmss.sss) and date (ddmmyy) fields are decoded by character position
+		bool time_field = (parser->id == SENTENCE_RMC || parser->id == SENTENCE_GGA) && parser->field_index == 1;
+		bool date_field = parser->id == SENTENCE_RMC && parser->field_index == 9;
+		if (time_field){
+			switch (i){
+			case 0: sentence->time.hours = digit * 10; break;
+			case 1: sentence->time.hours += digit; break;
+			case 2: sentence->time.minutes = digit * 10; break;
+			case 3: sentence->time.minutes += digit; break;
+			case 4: sentence->time.seconds = digit * 10; break;
+			case 5: sentence->time.seconds += digit; sentence->has_time = true; break;
+			case 7: sentence->time.microseconds = digit * 100000; break;
+			case 8: sentence->time.microseconds += digit * 10000; break;
+			case 9: sentence->time.microseconds += digit * 1000; break;
+			default: break;
+			}
+		} else if (date_field){
+			switch (i){
+			case 0: sentence->date.day = digit * 10; break;
+			case 1: sentence->date.day += digit; break;
+			case 2: sentence->date.month = digit * 10; break;
+			case 3: sentence->date.month += digit; break;
+			case 4: sentence->date.year = digit * 10; break;
+			case 5: sentence->date.year += digit; break;
+			default: break;
+			}
+		}
+	} else if (c == '.'){
+		parser->scale = 1;
+	}
+}
+
+static void field_end(nmea_parser_t *parser){
+	nmea_sentence_t *sentence = &parser->sentence;
+	minmea_float_t f = { parser->value, parser->scale ? parser->scale : 1 };
+	char first = parser->first_char;
+
+	switch (parser->id){
+	case SENTENCE_RMC:
+		switch (parser->field_index){
+		case 2: sentence->valid = (first == 'A'); break;
+		case 3:
+			sentence->latitude = f;
+			sentence->latitude_e7 = field_coordinate_e7(parser);
+			break;
+		case 4:
+			if (first == 'S'){
+				sentence->latitude.value = -sentence->latitude.value;
+				sentence->latitude_e7 = -sentence->latitude_e7;
+			}
+			break;
+		case 5:
+			sentence->longitude = f;
+			sentence->longitude_e7 = field_coordinate_e7(parser);
+			break;
+		case 6:
+			if (first == 'W'){
+				sentence->longitude.value = -sentence->longitude.value;
+				sentence->longitude_e7 = -sentence->longitude_e7;
+			}
+			break;
+		case 7: sentence->speed_mm_s = field_speed_mm_s(parser, KNOTS_E7_TO_MM_S_Q32); break;
+		case 8:
+			sentence->course = f;
+			sentence->course_centidegrees = field_centidegrees(parser);
+			break;
+		default: break;
+		}
+		break;
+	case SENTENCE_VTG:
+		switch (parser->field_index){
+		case 1:
+			sentence->course = f;
+			sentence->course_centidegrees = field_centidegrees(parser);
+			break;
+		case 7:
+			sentence->speed_kph = f;
+			sentence->speed_mm_s = field_speed_mm_s(parser, KPH_E7_TO_MM_S_Q32);
+			break;
+		default: break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	parser->field_index++;
+	field_reset(parser);
+}
+
+static void field_reset(nmea_parser_t *parser){
+	parser->char_index = 0;
+	parser->first_char = '\0';
+	parser->value = 0;
+	parser->scale = 0;
+	parser->integer_head = 0;
+	parser->integer_tens = 0;
+	parser->integer_ones = 0;
+	parser->fraction_digits = 0;
+	parser->fraction_e7 = 0;
+}
+
+static int32_t field_coordinate_e7(const nmea_parser_t *parser){
+	//DDDMM.MMMM - degrees are the head of the integer part, minutes its last two digits
+	uint32_t minutes_e7 = (parser->integer_tens * 10 + parser->integer_ones) * 10000000UL + parser->fraction_e7;
+	uint32_t degrees = parser->integer_head;
+	if (degrees > 180){
+		degrees = 180;
+	}
+	return degrees * 10000000 + (uint32_t)((minutes_e7 * RECIPROCAL_60_Q32) >> 32);
+}
+
+static uint32_t field_speed_mm_s(const nmea_parser_t *parser, uint64_t factor_q32){
+	uint32_t integer = parser->integer_head * 100 + parser->integer_tens * 10 + parser->integer_ones;
+	if (integer > MAX_SPEED){
+		integer = MAX_SPEED;
+	}
+	uint64_t speed_e7 = (uint64_t)integer * 10000000 + parser->fraction_e7;
+	return (speed_e7 * factor_q32) >> 32;
+}
+
+static uint16_t field_centidegrees(const nmea_parser_t *parser){
+	uint32_t integer = parser->integer_head * 100 + parser->integer_tens * 10 + parser->integer_ones;
+	if (integer > 360){ //malformed
+		integer = 0;
+	}
+	uint32_t centidegrees = integer * 100 + (uint32_t)((parser->fraction_e7 * RECIPROCAL_1E5_Q32) >> 32);
+	if (centidegrees >= 36000){
+		centidegrees -= 36000;
+	}
+	return centidegrees;
+}
+
+static uint8_t hex_value(char c){
+	if (c >= '0' && c <= '9'){
+		return c - '0';
+	}
+	if (c >= 'A' && c <= 'F'){
+		return c - 'A' + 10;
+	}
+	return 0xFF; //never matches a checksum
+}
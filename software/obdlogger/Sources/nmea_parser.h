@@ -0,0 +1,62 @@
+#ifndef SOURCES_NMEA_PARSER_H_
+#define SOURCES_NMEA_PARSER_H_
+#include "minmea.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+	nmea_sentence_other = 0,
+	nmea_sentence_rmc,
+	nmea_sentence_gga,
+	nmea_sentence_vtg,
+} nmea_sentence_id_t;
+
+typedef struct {
+	nmea_sentence_id_t id;
+	bool valid; //RMC status
+	bool has_time;
+	struct minmea_time time;
+	struct minmea_date date;
+
+	//values as transmitted (coordinates in NMEA DDDMM.MMMM), used by the log frames
+	minmea_float_t latitude;
+	minmea_float_t longitude;
+	minmea_float_t course;
+	minmea_float_t speed_kph;
+
+	//the same values pre-scaled to fixed point
+	int32_t latitude_e7; //1e-7 degrees
+	int32_t longitude_e7;
+	uint32_t speed_mm_s; //from VTG km/h or RMC knots
+	uint16_t course_centidegrees;
+} nmea_sentence_t;
+
+//zero-initialized parser waits for the first '$', holds no pointers
+typedef struct {
+	uint8_t state;
+	uint8_t checksum;
+	uint8_t received_checksum;
+	uint8_t field_index;
+	uint8_t char_index; //within the current field
+	char first_char;
+	uint32_t id; //last three characters of the address field
+
+	//numeric field accumulators
+	int32_t value; //minmea_float_t value/scale pair
+	int32_t scale; //0 until the decimal point is found
+	uint32_t integer_head; //integer part without its last two digits (degrees of DDDMM)
+	uint8_t integer_tens; //last two digits of the integer part (minutes of DDDMM)
+	uint8_t integer_ones;
+	uint8_t fraction_digits;
+	uint32_t fraction_e7; //fractional part in 1e-7 units
+
+	uint32_t checksum_errors;
+	nmea_sentence_t sentence; //valid after nmea_parser_consume() returned true
+} nmea_parser_t;
+
+//returns true when a complete sentence with a correct checksum was parsed,
+//fields of RMC, GGA and VTG sentences are in parser->sentence
+bool nmea_parser_consume(nmea_parser_t *parser, char c);
+void nmea_parser_reset(nmea_parser_t *parser); //drops the sentence being parsed
+
+#endif /* SOURCES_NMEA_PARSER_H_ */
@@ -27,12 +27,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <debug.h>
 
 #define MAX_PID_FAILURES 5
+#define K_LINE_REQUEST_GAP_ms 40 //ISO 9141/KWP2000 ECUs need a pause between requests
+#define CAN_REQUEST_GAP_ms 5
 
 typedef int32_t (*obd_get_pid_internal_func_t)(pid_mode_t mode, uint8_t pid, obd_pid_response_t *target_response);
 typedef void (*obd_phy_subtask_t)(void);
 
 static obd_get_pid_internal_func_t _obd_get_pid_internal_func;
 static obd_phy_subtask_t _obd_phy_subtask;
+static TickType_t _request_gap_ticks = pdMS_TO_TICKS(K_LINE_REQUEST_GAP_ms);
 
 #define OBD_INIT_TEST_PID 0x00 //PID used as for a test read, 0x00 = available PIDs 01-20
 
@@ -64,6 +67,7 @@ void obd_init(obd_protocol_t first_protocol_to_try){
 			debugf("Init okay - CAN 500kbaud standard id");
 			_obd_get_pid_internal_func = obd_can_get_pid;
 			_obd_phy_subtask = obd_can_task;
+			_request_gap_ticks = pdMS_TO_TICKS(CAN_REQUEST_GAP_ms);
 			detected_protocol = obd_proto_can_11b_500kbps;
 			break;
 		} else {
@@ -78,6 +82,7 @@ void obd_init(obd_protocol_t first_protocol_to_try){
 			debugf("Init okay - CAN 250kbaud standard id");
 			_obd_get_pid_internal_func = obd_can_get_pid;
 			_obd_phy_subtask = obd_can_task;
+			_request_gap_ticks = pdMS_TO_TICKS(CAN_REQUEST_GAP_ms);
 			detected_protocol = obd_proto_can_11b_250kbps;
 			break;
 		} else {
@@ -92,6 +97,7 @@ void obd_init(obd_protocol_t first_protocol_to_try){
 			debugf("Init okay - CAN 500kbaud extended id");
 			_obd_get_pid_internal_func = obd_can_get_pid;
 			_obd_phy_subtask = obd_can_task;
+			_request_gap_ticks = pdMS_TO_TICKS(CAN_REQUEST_GAP_ms);
 			detected_protocol = obd_proto_can_29b_500kbps;
 			break;
 		} else {
@@ -106,6 +112,7 @@ void obd_init(obd_protocol_t first_protocol_to_try){
 			debugf("Init okay - CAN 250kbaud extended id");
 			_obd_get_pid_internal_func = obd_can_get_pid;
 			_obd_phy_subtask = obd_can_task;
+			_request_gap_ticks = pdMS_TO_TICKS(CAN_REQUEST_GAP_ms);
 			detected_protocol = obd_proto_can_29b_250kbps;
 			break;
 		} else {
@@ -118,6 +125,7 @@ void obd_init(obd_protocol_t first_protocol_to_try){
 			debugf("Init okay - K-Line");
 			_obd_get_pid_internal_func = obd_k_line_get_pid;
 			_obd_phy_subtask = obd_k_line_task;
+			_request_gap_ticks = pdMS_TO_TICKS(K_LINE_REQUEST_GAP_ms);
 			break;
 		}
 
@@ -155,8 +163,14 @@ int32_t obd_get_pid(pid_mode_t mode, uint8_t pid, obd_pid_response_t *target_res
 			LED2_OFF();
 			obd_init(obd_proto_auto);
 		}
-	} else {
+		diagnostics_publish();
+	} else if (GLOBAL_diagnostics_frame.pid_get_failures){
 		GLOBAL_diagnostics_frame.pid_get_failures = 0;
+		diagnostics_publish();
 	}
 	return status;
 }
+
+TickType_t obd_get_request_gap_ticks(void){
+	return _request_gap_ticks;
+}
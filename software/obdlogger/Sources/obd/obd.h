@@ -27,5 +27,6 @@ void obd_init(obd_protocol_t first_protocol_to_try);
 void obd_deinit_from_ISR(void);
 void obd_task(void);
 int32_t obd_get_pid(pid_mode_t mode, uint8_t pid, obd_pid_response_t *target_response);
+TickType_t obd_get_request_gap_ticks(void); //minimum pause between consecutive PID requests
 
 #endif /* SOURCES_OBD_OBD_H_ */
@@ -19,27 +19,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 //common PID lengths taken from https://en.wikipedia.org/wiki/OBD-II_PIDs
 //used mostly in ISO 9191 mode as the responses don't contain length bytes
-static const uint8_t PID_INFO[256][2] = {
+static const uint8_t PID_INFO[256][3] = {
 		//first column - length
 		//second column - default sampling interval in seconds (0 - sample once, UINT8_MAX - don't sample)
+		//third column - fastest adaptive sampling interval in 100 ms units (omitted/0 - fixed sampling rate),
+		//                when the value is flat sampling backs off to the default interval
 		[0x0]  = { 4 , SAMPLE_ONCE }, //PIDs supported [01 - 20]
 		[0x1]  = { 4 , SAMPLE_ONCE }, //Monitor status since DTCs cleared. (Includes malfunction indicator lamp (MIL) status and number of DTCs.)
 		[0x2]  = { 2 , SAMPLE_ONCE }, //Freeze DTC
 		[0x3]  = { 2 , 30 }, //Fuel system status
-		[0x4]  = { 1 , 3 }, //Calculated engine load
-		[0x5]  = { 1 , 30 }, //Engine coolant temperature
+		[0x4]  = { 1 , 3 , 10 }, //Calculated engine load
+		[0x5]  = { 1 , 30 , 100 }, //Engine coolant temperature
 		[0x6]  = { 1 , 5 }, //Short term fuel trim—Bank 1
 		[0x7]  = { 1 , 5 }, //Long term fuel trim—Bank 1
 		[0x8]  = { 1 , 5 }, //Short term fuel trim—Bank 2
 		[0x9]  = { 1 , 5 }, //Long term fuel trim—Bank 2
 		[0x0A] = { 1 , 4 }, //Fuel pressure (gauge pressure)
-		[0x0B] = { 1 , 4 }, //Intake manifold absolute pressure
-		[0x0C] = { 2 , 1 }, //Engine RPM
-		[0x0D] = { 1 , 2 }, //Vehicle speed
-		[0x0E] = { 1 , 1 }, //Timing advance
+		[0x0B] = { 1 , 4 , 10 }, //Intake manifold absolute pressure
+		[0x0C] = { 2 , 1 , 2 }, //Engine RPM
+		[0x0D] = { 1 , 2 , 5 }, //Vehicle speed
+		[0x0E] = { 1 , 1 , 5 }, //Timing advance
 		[0x0F] = { 1 , 10 }, //Intake air temperature
-		[0x10] = { 2 , 1 }, //MAF air flow rate
-		[0x11] = { 1 , 1 }, //Throttle position
+		[0x10] = { 2 , 1 , 2 }, //MAF air flow rate
+		[0x11] = { 1 , 1 , 2 }, //Throttle position
 		[0x12] = { 1 , 10 }, //Commanded secondary air status
 		[0x13] = { 1 , 20 }, //Oxygen sensors present (in 2 banks)
 		[0x14] = { 2 , 20 }, //"Oxygen Sensor 1 A: Voltage B: Short term fuel trim"
@@ -69,11 +71,11 @@ static const uint8_t PID_INFO[256][2] = {
 		[0x2C] = { 1 , 10 }, //Commanded EGR
 		[0x2D] = { 1 , 10 }, //EGR Error
 		[0x2E] = { 1 , 20 }, //Commanded evaporative purge
-		[0x2F] = { 1 , 30 }, //Fuel Tank Level Input
+		[0x2F] = { 1 , 30 , 100 }, //Fuel Tank Level Input
 		[0x30] = { 1 , 100 }, //Warm-ups since codes cleared
 		[0x31] = { 2 , 100 }, //Distance traveled since codes cleared
 		[0x32] = { 2 , 60 }, //Evap. System Vapor Pressure
-		[0x33] = { 1 , 30 }, //Absolute Barometric Pressure
+		[0x33] = { 1 , 30 , 100 }, //Absolute Barometric Pressure
 		[0x34] = { 4 , 20 }, //"Oxygen Sensor 1 AB: Fuel–Air Equivalence Ratio CD: Current"
 		[0x35] = { 4 , 20 }, //"Oxygen Sensor 2 AB: Fuel–Air Equivalence Ratio CD: Current"
 		[0x36] = { 4 , 20 }, //"Oxygen Sensor 3 AB: Fuel–Air Equivalence Ratio CD: Current"
@@ -92,13 +94,13 @@ static const uint8_t PID_INFO[256][2] = {
 		[0x43] = { 2 , 10 }, //Absolute load value
 		[0x44] = { 2 , 10 }, //Fuel–Air commanded equivalence ratio
 		[0x45] = { 1 , 10 }, //Relative throttle position
-		[0x46] = { 1 , 30 }, //Ambient air temperature
-		[0x47] = { 1 , 3 }, //Absolute throttle position B
-		[0x48] = { 1 , 3 }, //Absolute throttle position C
-		[0x49] = { 1 , 3 }, //Accelerator pedal position D
-		[0x4A] = { 1 , 3 }, //Accelerator pedal position E
-		[0x4B] = { 1 , 3 }, //Accelerator pedal position F
-		[0x4C] = { 1 , 3 }, //Commanded throttle actuator
+		[0x46] = { 1 , 30 , 100 }, //Ambient air temperature
+		[0x47] = { 1 , 3 , 5 }, //Absolute throttle position B
+		[0x48] = { 1 , 3 , 5 }, //Absolute throttle position C
+		[0x49] = { 1 , 3 , 5 }, //Accelerator pedal position D
+		[0x4A] = { 1 , 3 , 5 }, //Accelerator pedal position E
+		[0x4B] = { 1 , 3 , 5 }, //Accelerator pedal position F
+		[0x4C] = { 1 , 3 , 5 }, //Commanded throttle actuator
 		[0x4D] = { 2 , 100 }, //Time run with MIL on
 		[0x4E] = { 2 , 100 }, //Time since trouble codes cleared
 		[0x4F] = { 4 , SAMPLE_ONCE }, //Maximum value for Fuel–Air equivalence ratio, oxygen sensor voltage, oxygen sensor current, and intake manifold absolute pressure
@@ -116,11 +118,11 @@ static const uint8_t PID_INFO[256][2] = {
 		[0x5B] = { 1 , 254 }, //Hybrid battery pack remaining life
 		[0x5C] = { 1 , 10 }, //Engine oil temperature
 		[0x5D] = { 2 , 5 }, //Fuel injection timing
-		[0x5E] = { 2 , 2 }, //Engine fuel rate
+		[0x5E] = { 2 , 2 , 5 }, //Engine fuel rate
 		[0x5F] = { 1 , SAMPLE_ONCE }, //Emission requirements to which vehicle is designed
 		[0x60] = { 4 , SAMPLE_ONCE }, //PIDs supported [61 - 80]
-		[0x61] = { 1 , 2 }, //Driver's demand engine - percent torque
-		[0x62] = { 1 , 2 }, //Actual engine - percent torque
+		[0x61] = { 1 , 2 , 5 }, //Driver's demand engine - percent torque
+		[0x62] = { 1 , 2 , 5 }, //Actual engine - percent torque
 		[0x63] = { 2 , SAMPLE_ONCE }, //Engine reference torque
 		[0x64] = { 5 , DONT_SAMPLE }, //Engine percent torque data
 		[0x65] = { 2 , SAMPLE_ONCE }, //Auxiliary input / output supported
@@ -177,3 +179,10 @@ uint8_t obd_pid_get_default_sampling_interval_seconds(pid_mode_t mode, uint8_t p
 	}
 	return DONT_SAMPLE; //unknown PID type
 }
+
+uint16_t obd_pid_get_adaptive_min_sampling_interval_ms(pid_mode_t mode, uint8_t pid){
+	if (mode == pid_mode_01){
+		return PID_INFO[pid][2] * 100;
+	}
+	return 0; //fixed sampling rate
+}
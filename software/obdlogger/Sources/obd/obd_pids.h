@@ -10,4 +10,6 @@ uint8_t obd_pid_get_length(pid_mode_t mode, uint8_t pid);
 
 uint8_t obd_pid_get_default_sampling_interval_seconds(pid_mode_t mode, uint8_t pid);
 
+uint16_t obd_pid_get_adaptive_min_sampling_interval_ms(pid_mode_t mode, uint8_t pid); //0 - fixed sampling rate
+
 #endif /* SOURCES_OBD_OBD_PIDS_H_ */
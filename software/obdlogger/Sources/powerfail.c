@@ -0,0 +1,183 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <FreeRTOS/include/FreeRTOS.h>
+#include <adc.h>
+#include <FatFS/diskio.h>
+#include "file_paths.h"
+#include "logger_core.h"
+#include <misc.h>
+#include "powerfail.h"
+#include <string.h>
+#include "timestamp.h"
+
+#define DEBUG_ID DEBUG_ID_STORAGE_TASK
+#include <debug.h>
+
+/* Emergency flush after a power drop with a bounded number of sector writes.
+ *
+ * The log file is kept POWERFAIL_RESERVE_BYTES longer than its data and the
+ * reserved clusters are erased, so the flush never allocates clusters and the
+ * FAT is already on the card. It writes only the last data sectors and the
+ * directory entry (whose cluster and size are unchanged), then a commit record
+ * to a fixed sector of POWER_FAIL_RECORD_PATH.
+ *
+ * The record holds the flush duration and the supply voltage before and after
+ * it, the next boot logs it as a power fail frame. The reserve is trimmed when
+ * the file is closed normally, otherwise the log ends with erased bytes, which
+ * are skipped by frame parsers.
+ */
+
+#define POWERFAIL_RESERVE_BYTES 65536
+#define POWERFAIL_MIN_RESERVE_BYTES 1024 //log write buffer plus a partial sector
+#define POWERFAIL_RECORD_MAGIC 0x46525750 //"PWRF"
+#define SECTOR_SIZE 512
+
+typedef struct {
+	uint32_t magic;
+	frame_power_fail_t stats;
+} powerfail_record_t;
+
+static FATFS *_fs;
+static DWORD _record_sector; //0 = record file is not available
+static powerfail_record_t _record; //stats of this session
+static frame_power_fail_t _previous; //stats of the previous session, flush_count 0 if none
+
+static void record_write(void);
+
+void powerfail_init(FATFS *fs, FIL *scratch){
+	_fs = fs;
+
+	FRESULT r = f_open(scratch, POWER_FAIL_RECORD_PATH, FA_OPEN_ALWAYS | FA_READ | FA_WRITE);
+	if (r != FR_OK){
+		debugf("power fail record open %d", r);
+		return;
+	}
+
+	UINT bytes_read = 0;
+	powerfail_record_t record;
+	r = f_read(scratch, &record, sizeof(record), &bytes_read);
+	if (r == FR_OK && bytes_read == sizeof(record) && record.magic == POWERFAIL_RECORD_MAGIC){
+		_previous = record.stats;
+		_previous.flags |= POWER_FAIL_FLAG_PREVIOUS_BOOT;
+	}
+
+	//clear the record and make it one full sector, so it has a cluster to be written to directly
+	memset(&record, 0, sizeof(record));
+	UINT bytes_written = 0;
+	f_lseek(scratch, 0);
+	f_write(scratch, &record, sizeof(record), &bytes_written);
+	if (f_size(scratch) < SECTOR_SIZE){
+		f_lseek(scratch, SECTOR_SIZE);
+	}
+	r = f_sync(scratch);
+	if (r == FR_OK && scratch->obj.sclust >= 2){
+		_record_sector = fs->database + (scratch->obj.sclust - 2) * fs->csize;
+	}
+	f_close(scratch);
+	debugf("power fail record sector %ld", _record_sector);
+
+	_record.magic = POWERFAIL_RECORD_MAGIC;
+	_record.stats.frame_type = logger_frame_power_fail;
+}
+
+void powerfail_report(void){
+	if (_previous.flush_count){
+		debugf("previous session: %d emergency flushes, slowest %ldus, ADC %d -> %d",
+				_previous.flush_count, _previous.duration_us,
+				_previous.voltage_start_adc_code, _previous.voltage_end_adc_code);
+		_previous.timestamp = xTaskGetTickCount();
+		log_power_fail(&_previous);
+	}
+}
+
+void powerfail_reserve(FIL *log_file){
+	FSIZE_t position = f_tell(log_file);
+	FSIZE_t old_size = f_size(log_file);
+	if (old_size - position >= POWERFAIL_RESERVE_BYTES / 2){
+		return;
+	}
+
+	//seeking past the end allocates clusters, syncing writes the FAT and directory entry now
+	f_lseek(log_file, position + POWERFAIL_RESERVE_BYTES);
+	f_sync(log_file);
+
+	//erase every newly allocated cluster, they may not be contiguous
+	FSIZE_t cluster_bytes = (FSIZE_t)_fs->csize * SECTOR_SIZE;
+	FSIZE_t offset = (old_size + cluster_bytes - 1) & ~(cluster_bytes - 1); //first new cluster
+	for (; offset < f_size(log_file); offset += cluster_bytes){
+		f_lseek(log_file, offset + 1); //inside the cluster, so clust points to it
+		DWORD range[2];
+		range[0] = _fs->database + (log_file->clust - 2) * _fs->csize;
+		range[1] = range[0] + _fs->csize - 1;
+		disk_ioctl(_fs->drv, CTRL_TRIM, range); //not every card supports erase
+	}
+
+	f_lseek(log_file, position);
+	debugf("log reserve %ld -> %ld bytes", old_size - position, f_size(log_file) - position);
+}
+
+void powerfail_release(FIL *log_file){
+	f_truncate(log_file);
+	f_sync(log_file);
+}
+
+void powerfail_flush(FIL *log_file){
+	TickType_t start;
+	uint8_t start_fraction;
+	timestamp_get(&start, &start_fraction);
+	uint16_t voltage_start = adc_get_result();
+
+	bool reserve_ok = f_size(log_file) - f_tell(log_file) >= POWERFAIL_MIN_RESERVE_BYTES;
+	log_flush();
+	f_sync(log_file);
+
+	TickType_t end;
+	uint8_t end_fraction;
+	timestamp_get(&end, &end_fraction);
+	uint16_t voltage_end = adc_get_result();
+
+	uint32_t subticks = (end - start) * 256 + end_fraction - start_fraction;
+	uint32_t duration_us = ((uint64_t)subticks * (1000000 / configTICK_RATE_HZ)) >> 8;
+
+	frame_power_fail_t *stats = &_record.stats;
+	if (stats->flush_count < UINT8_MAX){
+		stats->flush_count++;
+	}
+	if (reserve_ok == false){
+		stats->flags |= POWER_FAIL_FLAG_RESERVE_EXHAUSTED;
+	}
+	if (duration_us >= stats->duration_us){
+		stats->duration_us = duration_us;
+		stats->voltage_start_adc_code = voltage_start;
+		stats->voltage_end_adc_code = voltage_end;
+	}
+	record_write();
+	debugf("emergency flush %ldus", duration_us);
+}
+
+static void record_write(void){
+	//the FatFS window is the only free sector buffer, it can be borrowed when it is clean
+	if (_record_sector == 0 || _fs->wflag){
+		return;
+	}
+	memset(_fs->win, 0, SECTOR_SIZE);
+	memcpy(_fs->win, &_record, sizeof(_record));
+	_fs->winsect = 0xFFFFFFFF; //window no longer holds any sector, FatFS reloads it
+	disk_write(_fs->drv, _fs->win, _record_sector, 1);
+	disk_ioctl(_fs->drv, CTRL_SYNC, 0);
+}
@@ -0,0 +1,12 @@
+#ifndef SOURCES_POWERFAIL_H_
+#define SOURCES_POWERFAIL_H_
+#include <FatFS/ff.h>
+
+//Functions to be called only from the storage task
+void powerfail_init(FATFS *fs, FIL *scratch); //before the log file is opened, scratch is used temporarily
+void powerfail_report(void); //logs stats of the previous session, after log_init()
+void powerfail_reserve(FIL *log_file); //keeps clusters allocated and erased ahead of the write pointer
+void powerfail_release(FIL *log_file); //trims the reserve, call before the log file is closed
+void powerfail_flush(FIL *log_file); //bounded and measured flush after a power drop
+
+#endif /* SOURCES_POWERFAIL_H_ */
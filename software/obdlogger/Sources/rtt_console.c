@@ -86,6 +86,8 @@ static void _execute_cmd(uint32_t argc, char *argv[]){
 		if (argv[0][0] == 's'){
 			debugf("Syncing log");
 			storage_sync();
+		} else if (argv[0][0] == 'w'){
+			storage_io_report();
 		} else if (argv[0][0] == '0'){
 			debugf("SPI0 CS low");
 			spi0_cs_low();
@@ -116,6 +118,10 @@ static void _execute_cmd(uint32_t argc, char *argv[]){
 			a = 0;
 			*a = 5; //kaboom!
 		}
+	} else if (argc == 2){
+		if (argv[0][0] == 't'){
+			debug_rtt_text_output(atoi(argv[1]));
+		}
 	} else if (argc == 3){
 		if (argv[0][0] == 'd'){
 			debug_enable_id(atoi(argv[1]), atoi(argv[2]));
@@ -0,0 +1,42 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <MKE06Z4.h>
+#include <misc.h>
+#include "seqlock.h"
+#include <string.h>
+
+void seqlock_publish(seqlock_t *lock, const void *data){
+	uint32_t next = lock->sequence + 1;
+	memcpy(lock->buffers[next & 1], data, lock->size);
+	__DMB(); //data must be in memory before readers can select the buffer
+	lock->sequence = next;
+}
+
+void seqlock_read(const seqlock_t *lock, void *target){
+	uint32_t sequence;
+	do {
+		sequence = lock->sequence;
+		__DMB();
+		memcpy(target, lock->buffers[sequence & 1], lock->size);
+		__DMB();
+	} while (unlikely(lock->sequence != sequence)); //a writer preempted this copy - try again
+}
+
+const void *seqlock_peek(const seqlock_t *lock){
+	return lock->buffers[lock->sequence & 1];
+}
@@ -0,0 +1,26 @@
+#ifndef SOURCES_SEQLOCK_H_
+#define SOURCES_SEQLOCK_H_
+#include <stdint.h>
+
+/* Publication of a struct from one writer to any number of readers
+ * (tasks or ISRs) without disabling interrupts.
+ *
+ * The writer fills the buffer readers are not using and then increments
+ * the sequence, which also selects the buffer to read. A reader copies the
+ * current buffer and retries if the sequence changed meanwhile, so it never
+ * waits for a writer it has preempted.
+ */
+typedef struct {
+	volatile uint32_t sequence; //number of publications, bit 0 selects the buffer to read
+	void *const buffers[2];
+	const uint32_t size;
+} seqlock_t;
+
+//array has two elements, both should hold the initial value
+#define SEQLOCK_INIT(array) { .sequence = 0, .buffers = { &(array)[0], &(array)[1] }, .size = sizeof((array)[0]) }
+
+void seqlock_publish(seqlock_t *lock, const void *data); //single writer only
+void seqlock_read(const seqlock_t *lock, void *target);
+const void *seqlock_peek(const seqlock_t *lock); //current buffer, for single field reads only
+
+#endif /* SOURCES_SEQLOCK_H_ */
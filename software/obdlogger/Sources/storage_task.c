@@ -19,19 +19,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "adc.h"
 #include "application_tasks.h"
 #include <crash_handler.h>
+#include "dead_reckoning.h"
+#include <FatFS/diskio.h>
 #include <FatFS/ff.h>
 #include "file_paths.h"
+#include "geofence.h"
+#include "log_recovery.h"
+#include "log_space.h"
 #include <gps_core.h>
 #include <gps_uart.h>
 #include "logger_core.h"
 #include <misc.h>
 #include <pins.h>
 #include "power.h"
+#include "powerfail.h"
 #include "rtt_console.h"
 #include <stdlib.h>
 #include <string.h>
 #include "storage_task.h"
 #include "timer.h"
+#include "trip_summary.h"
 
 #define DEBUG_ID DEBUG_ID_STORAGE_TASK
 #include <debug.h>
@@ -39,10 +46,33 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 static FATFS _fat;
 static FIL _file_handle;
 
+//log segmentation, limits are set by the R config line (0 - no limit)
+static uint32_t _segment_max_bytes = 0;
+static TickType_t _segment_max_ticks = 0;
+static TickType_t _segment_start;
+static log_index_record_t _current_log; //sequence is the segment number
+static bool _log_named = false; //the log was renamed by GPS time
+
 static void log_filename_migration_subtask(void);
+static void log_rotation_subtask(void);
+static void storage_io_debug_subtask(void);
+static void storage_io_sync(void);
+static void log_path_from_gps(char *path, uint32_t path_size, const frame_gps_t *gps, log_index_record_t *log);
+static bool recover_orphaned_log(void);
 __attribute__((noreturn)) static void blink_of_death(void);
-static void load_config_file(FIL *config_file_handle);
-static void config_parse_line(uint32_t argc, char *argv[]);
+static bool load_config_file(FIL *config_file_handle);
+static uint32_t config_tokenize(char *line, char *argv[]);
+static bool config_parse_line(uint32_t argc, char *argv[]);
+static bool config_parse_channel_line(uint32_t argc, char *argv[]);
+static bool config_parse_trigger_line(uint32_t argc, char *argv[]);
+static bool config_parse_budget_line(uint32_t argc, char *argv[]);
+static bool config_parse_gps_line(uint32_t argc, char *argv[]);
+static bool config_parse_storage_line(uint32_t argc, char *argv[]);
+static bool config_parse_geofence_line(uint32_t argc, char *argv[]);
+static bool config_parse_degrees(const char *text, int32_t *degrees_e7);
+static bool config_pid_mode_valid(uint32_t pid_mode);
+static bool config_parse_number(const char *text, uint32_t max, uint32_t *value);
+static bool config_parse_interval(const char *text, TickType_t *interval);
 
 void storage_task(void *params __attribute__((unused))){
 
@@ -80,13 +110,7 @@ void storage_task(void *params __attribute__((unused))){
 	//This will give time the GPS to start after power-on.
 
 	//read configuration
-	bool use_default_config = true;
-	r = f_open(&_file_handle, CONFIG_PATH, FA_READ);
-	if (r == FR_OK){
-		use_default_config = false;
-		load_config_file(&_file_handle);
-		f_close(&_file_handle);
-	}
+	bool use_default_config = load_config_file(&_file_handle) == false;
 
 	//read previously used protocol
 	obd_protocol_t first_protocol_to_try = obd_proto_auto;
@@ -101,8 +125,15 @@ void storage_task(void *params __attribute__((unused))){
 		f_close(&_file_handle);
 	}
 
+	powerfail_init(&_fat, &_file_handle);
+	log_space_init(&_fat, &_file_handle);
+	trip_summary_init(&_fat, &_file_handle);
+	//the temporary log is overwritten below, unless the previous one couldn't be renamed -
+	//then the new trip is appended to it (it was truncated after the last valid frame)
+	bool tmp_log_free = recover_orphaned_log();
+
 	//open the logfile
-	r = f_open(&_file_handle, TMP_LOG_PATH, FA_CREATE_ALWAYS | FA_WRITE);
+	r = f_open(&_file_handle, TMP_LOG_PATH, (tmp_log_free ? FA_CREATE_ALWAYS : FA_OPEN_APPEND) | FA_WRITE);
 	debugf("log file open file status = %d", r);
 	if (r != FR_OK && r != FR_EXIST){
 		blink_of_death();
@@ -112,6 +143,8 @@ void storage_task(void *params __attribute__((unused))){
 
 	gps_uart_init();
 	log_init(&_file_handle);
+	powerfail_reserve(&_file_handle);
+	powerfail_report();
 
 	debugf("SRSID %08X <%s>", (unsigned int)SIM_SRSID, crash_handler_get_info());
 
@@ -120,7 +153,8 @@ void storage_task(void *params __attribute__((unused))){
 	while (1){
 		if (GLOBAL_power_failure_flag){
 			debugf("Power drop"); //this may be a temporary glitch (eg. wipers or fans being turned on)
-			storage_sync();
+			log_aggregate_close_all();
+			powerfail_flush(&_file_handle); //log data first, the debug file may need new clusters
 			debug_file_task();
 			debug_sync();
 
@@ -128,11 +162,14 @@ void storage_task(void *params __attribute__((unused))){
 			vTaskResume(&acquisition_task_handle); //continue running
 			GLOBAL_power_failure_flag = false;
 		} else {
-			debug_file_task();
+			storage_io_debug_subtask();
 			gps_uart_task();
 			static uint32_t frames_saved = 0;
-			frames_saved += log_task();
+			uint32_t frames = log_task();
+			frames_saved += frames;
+			trip_summary_frames(frames);
 			log_filename_migration_subtask();
+			log_rotation_subtask();
 			rtt_console_task();
 			static TickType_t last_check = 0;
 
@@ -140,26 +177,31 @@ void storage_task(void *params __attribute__((unused))){
 			if (xTaskGetTickCount() - last_check > pdMS_TO_TICKS(20000)){
 				last_check = xTaskGetTickCount();
 				uint32_t stack_water_mark = uxTaskGetStackHighWaterMark(&storage_task_handle);
+				frame_gps_t gps;
+				gps_core_get_current(&gps);
 				debugf("stack left %ld, frames %ld, GPS %d %02d%02d%02d %02d%02d%02d",
 						stack_water_mark*sizeof(UBaseType_t),
 						frames_saved,
-						GLOBAL_frame_gps_current.valid,
-						GLOBAL_frame_gps_current.date.year,
-						GLOBAL_frame_gps_current.date.month,
-						GLOBAL_frame_gps_current.date.day,
-						GLOBAL_frame_gps_current.time.hours,
-						GLOBAL_frame_gps_current.time.minutes,
-						GLOBAL_frame_gps_current.time.seconds);
+						gps.valid,
+						gps.date.year,
+						gps.date.month,
+						gps.date.day,
+						gps.time.hours,
+						gps.time.minutes,
+						gps.time.seconds);
 				frames_saved = 0;
 
-				storage_sync();
-				debug_sync();
+				storage_io_report();
+				storage_io_sync();
 			}
 
 			if (GLOBAL_power_failure_flag == false){ //else don't sleep - loop and flush the buffers immediately
 				if (power_is_good() == false){
 					debugf("Voltage is too low - shutting down");
+					log_aggregate_close_all();
 					storage_sync();
+					trip_summary_close();
+					powerfail_release(&_file_handle);
 					debug_file_task();
 					debug_sync();
 					power_shutdown();
@@ -167,7 +209,7 @@ void storage_task(void *params __attribute__((unused))){
 				vTaskDelay(2);
 			}
 
-			if (GLOBAL_frame_gps_current.valid){
+			if (gps_core_is_valid()){
 				LED3_ON();
 			} else {
 				LED3_OFF();
@@ -183,9 +225,10 @@ static void log_filename_migration_subtask(void){
 	 *
 	 * Example: "obdlog/2017/06/08101509.log" //2017, 8th June, 10:15 UTC
 	 */
-	static bool migrated = false;
-	if (unlikely(migrated == false)){
-		if (GLOBAL_frame_gps_current.valid && GLOBAL_frame_gps_current.time.seconds){
+	if (unlikely(_log_named == false)){
+		frame_gps_t gps;
+		gps_core_get_current(&gps);
+		if (gps.valid && gps.time.seconds){
 
 			//flush the debug buffer, so messages from this block will not get dropped
 			debug_file_task();
@@ -194,25 +237,11 @@ static void log_filename_migration_subtask(void){
 			char scratchpad[32];
 			FRESULT r;
 
-			//create year directory
-			snprintf(scratchpad, sizeof(scratchpad), "obdlog/%02d", GLOBAL_frame_gps_current.date.year);
-			r = f_mkdir(scratchpad);
-			debugf("mkdir %s %d", scratchpad, r);
-			if (r != FR_OK && r != FR_EXIST){
-				blink_of_death();
-			}
-
-			//create month directory
-			snprintf(scratchpad, sizeof(scratchpad), "obdlog/%02d/%02d",
-					GLOBAL_frame_gps_current.date.year,
-					GLOBAL_frame_gps_current.date.month);
-			r = f_mkdir(scratchpad);
-			debugf("mkdir %s %d", scratchpad, r);
-			if (r != FR_OK && r != FR_EXIST){
-				blink_of_death();
-			}
+			log_path_from_gps(scratchpad, sizeof(scratchpad), &gps, &_current_log);
 
 			//close temporary file (FAT may be otherwise damaged)
+			powerfail_release(&_file_handle); //FA_OPEN_APPEND below must find the end of data
+			_current_log.size = f_size(&_file_handle);
 			r = f_close(&_file_handle);
 			debugf("close %d", r);
 			if (r != FR_OK && r != FR_EXIST){
@@ -220,18 +249,12 @@ static void log_filename_migration_subtask(void){
 			}
 
 			//rename temporary file
-			snprintf(scratchpad, sizeof(scratchpad), "obdlog/%02d/%02d/%02d%02d%02d%02d.log",
-					GLOBAL_frame_gps_current.date.year,
-					GLOBAL_frame_gps_current.date.month,
-					GLOBAL_frame_gps_current.date.day,
-					GLOBAL_frame_gps_current.time.hours,
-					GLOBAL_frame_gps_current.time.minutes,
-					GLOBAL_frame_gps_current.time.seconds);
 			r = f_rename(TMP_LOG_PATH, scratchpad);
 			debugf("rename to %s %d", scratchpad, r);
 			if (r != FR_OK && r != FR_EXIST){
 				blink_of_death();
 			}
+			log_space_add(&_file_handle, &_current_log, true);
 
 			//open final file, move pointer to the end
 			r = f_open(&_file_handle, scratchpad, FA_OPEN_APPEND | FA_WRITE);
@@ -239,83 +262,865 @@ static void log_filename_migration_subtask(void){
 			if (r != FR_OK && r != FR_EXIST){
 				blink_of_death();
 			}
+			powerfail_reserve(&_file_handle);
+
+			_segment_start = xTaskGetTickCount();
+			_log_named = true;
+		}
+	}
+}
+
+static void log_rotation_subtask(void){
+	/* When the current segment reaches the size or time limit it is closed and the
+	 * next one is created: obdlog/YEAR/MONTH/DAYHOURMINUTESECOND.001, .002, ...
+	 * (8.3 names only - the sequence number is the extension). The time in the name is
+	 * the start of the trip, so all segments of one trip sort together.
+	 *
+	 * Frames produced during the switch wait in the logger queue and are written to the
+	 * new segment, nothing is lost. The power fail reserve of the new segment is
+	 * allocated right after it is opened, so a power drop can't hit an unreserved segment.
+	 */
+	if (likely(_log_named == false)){
+		return; //rotation starts after the log is named by GPS time
+	}
+	bool size_reached = _segment_max_bytes && f_tell(&_file_handle) >= _segment_max_bytes;
+	bool time_reached = _segment_max_ticks && xTaskGetTickCount() - _segment_start >= _segment_max_ticks;
+	if (likely(!size_reached && !time_reached) || _current_log.sequence >= 999){
+		return;
+	}
+
+	TickType_t switch_start = xTaskGetTickCount();
+	char path[32];
+	FRESULT r;
+
+	log_flush();
+	powerfail_release(&_file_handle);
+	log_space_closed(f_size(&_file_handle));
+	r = f_close(&_file_handle);
+	if (r != FR_OK){
+		blink_of_death();
+	}
+
+	_current_log.sequence++;
+	_current_log.size = 0;
+	log_space_path(path, sizeof(path), &_current_log);
+	log_space_add(&_file_handle, &_current_log, true);
+
+	r = f_open(&_file_handle, path, FA_CREATE_ALWAYS | FA_WRITE);
+	if (r != FR_OK){
+		blink_of_death();
+	}
+	powerfail_reserve(&_file_handle); //don't wait for housekeeping, a power drop may come first
+	_segment_start = xTaskGetTickCount();
+
+	//every segment can be decoded on its own
+	log_internal_diagnostics();
+	log_time_sync();
+
+	debugf("segment %s open, switch took %ld ticks", path, _segment_start - switch_start);
+}
+
+//creates the year and month directories, path is "obdlog/YEAR/MONTH/DAYHOURMINUTESECOND.log"
+static void log_path_from_gps(char *path, uint32_t path_size, const frame_gps_t *gps, log_index_record_t *log){
+	FRESULT r;
+
+	//create year directory
+	snprintf(path, path_size, "obdlog/%02d", gps->date.year);
+	r = f_mkdir(path);
+	debugf("mkdir %s %d", path, r);
+	if (r != FR_OK && r != FR_EXIST){
+		blink_of_death();
+	}
+
+	//create month directory
+	snprintf(path, path_size, "obdlog/%02d/%02d",
+			gps->date.year,
+			gps->date.month);
+	r = f_mkdir(path);
+	debugf("mkdir %s %d", path, r);
+	if (r != FR_OK && r != FR_EXIST){
+		blink_of_death();
+	}
+
+	memset(log, 0, sizeof(*log));
+	log->year = gps->date.year;
+	log->month = gps->date.month;
+	log->day = gps->date.day;
+	log->hours = gps->time.hours;
+	log->minutes = gps->time.minutes;
+	log->seconds = gps->time.seconds;
+	log_space_path(path, path_size, log);
+}
+
+static bool recover_orphaned_log(void){
+	/* A temporary log left from the previous boot was never renamed - power was lost
+	 * or there was no GPS fix. It is truncated after the last valid frame and renamed
+	 * by the last GPS time in it, or to the first free obdlog/recNNNNN.log without one
+	 * or if the GPS name can't be used. Returns false if the log is still in TMP_LOG_PATH.
+	 */
+	FRESULT r = f_open(&_file_handle, TMP_LOG_PATH, FA_READ | FA_WRITE);
+	if (r != FR_OK){
+		return true;
+	}
+
+	frame_gps_t gps;
+	bool has_data = log_recovery_truncate(&_file_handle, &gps);
+	uint32_t size = f_size(&_file_handle);
+	r = f_close(&_file_handle);
+	if (has_data == false){
+		return true; //nothing to keep
+	}
+	if (r != FR_OK){
+		return false;
+	}
 
-			migrated = true;
+	char path[32];
+	log_index_record_t log;
+	if (gps.valid){
+		log_path_from_gps(path, sizeof(path), &gps, &log);
+		r = f_rename(TMP_LOG_PATH, path);
+		debugf("recovered log renamed to %s %d", path, r);
+	}
+	if (gps.valid == false || r != FR_OK){
+		memset(&log, 0, sizeof(log));
+		log.flags = LOG_INDEX_FLAG_RECOVERED;
+		r = FR_EXIST;
+		while (r == FR_EXIST && log.sequence < 100000){
+			log_space_path(path, sizeof(path), &log);
+			r = f_rename(TMP_LOG_PATH, path);
+			if (r == FR_EXIST){
+				log.sequence++;
+			}
 		}
+		debugf("recovered log renamed to %s %d", path, r);
 	}
+	if (r != FR_OK){
+		return false;
+	}
+	log.size = size;
+	log_space_add(&_file_handle, &log, false);
+	return true;
 }
 
-#define MAX_OPTIONS 5
-static void load_config_file(FIL *config_file_handle){
-	char line_buffer[64];
-	while (f_gets(line_buffer, sizeof(line_buffer), config_file_handle)){
-		//		debugf("Line <%s>", line_buffer);
-		if (line_buffer[0] == '#'){ //ignore comment lines
-			debugf("Comment line");
+/* config.txt is parsed in a single pass. The file is read in CONFIG_CHUNK_SIZE blocks
+ * (f_gets would call f_read for every byte), each complete line is split into tokens
+ * and dispatched through _config_commands, which also checks the number of arguments.
+ * A line that fails validation is rejected as a whole and reported with its file and
+ * line number, the rest of the file is still loaded.
+ *
+ * "include PATH" continues with another file and returns to the line after it. There is
+ * only one FIL, so the parent file is closed and reopened at the saved offset.
+ */
+#define CONFIG_LINE_SIZE 64
+#define CONFIG_CHUNK_SIZE 32
+#define CONFIG_MAX_TOKENS 8
+#define CONFIG_MAX_INCLUDE_DEPTH 3 //config.txt and two levels of includes
+#define CONFIG_PATH_SIZE 20 //"obdlog/" and an 8.3 name
+#define CONFIG_MAX_INTERVAL_MS 3600000 //pdMS_TO_TICKS overflows above ~6 hours
+
+typedef struct {
+	char path[CONFIG_PATH_SIZE];
+	uint32_t offset; //bytes consumed, parsing continues here after an include
+	uint32_t line_number;
+} config_file_t;
+
+static bool load_config_file(FIL *config_file_handle){
+	config_file_t files[CONFIG_MAX_INCLUDE_DEPTH];
+	uint32_t depth = 0;
+	strcpy(files[0].path, CONFIG_PATH);
+	files[0].offset = 0;
+	files[0].line_number = 0;
+
+	char line_buffer[CONFIG_LINE_SIZE];
+	char chunk[CONFIG_CHUNK_SIZE];
+	char* argv[CONFIG_MAX_TOKENS+2]; //room for the NULL terminator and a PID name expanded to two tokens
+	uint32_t rejected_lines = 0;
+
+	while (1){
+		config_file_t *current = &files[depth];
+		FRESULT r = f_open(config_file_handle, current->path, FA_READ);
+		if (r == FR_OK){
+			r = f_lseek(config_file_handle, current->offset);
+		}
+		if (r != FR_OK){
+			debugf("Can't open config file %s: %d", current->path, r);
+			f_close(config_file_handle);
+			if (depth == 0){
+				return false;
+			}
+			rejected_lines++; //the include line
+			depth--;
 			continue;
 		}
-		//tokenize the command string by spaces
-		char* argv[MAX_OPTIONS];
-		uint32_t argc = 1;
-		uint32_t original_length = strlen(line_buffer);
-		argv[0] = line_buffer;
-		for (uint8_t i = 0; i < original_length; i++){
-			if (line_buffer[i] == ' '){ //space separates command arguments
-				line_buffer[i] = '\0';
-				argv[argc] = line_buffer + i + 1;
-				argc++;
-				if (argc > MAX_OPTIONS-1){
-					debugf("too many arguments");
+
+		uint32_t length = 0;
+		bool overflow = false;
+		bool include = false;
+		bool end_of_file = false;
+		while (include == false && end_of_file == false){
+			UINT chunk_length = 0;
+			if (f_read(config_file_handle, chunk, sizeof(chunk), &chunk_length) != FR_OK || chunk_length == 0){
+				end_of_file = true;
+				if (length == 0 && overflow == false){
+					break;
+				}
+				chunk[0] = '\n'; //the last line has no line break
+				chunk_length = 1;
+			}
+
+			for (uint32_t i = 0; i < chunk_length; i++){
+				current->offset++;
+				if (chunk[i] == '\r'){
+					continue;
+				}
+				if (chunk[i] != '\n'){
+					if (length < CONFIG_LINE_SIZE-1){
+						line_buffer[length++] = chunk[i];
+					} else {
+						overflow = true;
+					}
 					continue;
 				}
+
+				current->line_number++;
+				line_buffer[length] = '\0';
+				length = 0;
+				bool accepted;
+				uint32_t argc = overflow ? 0 : config_tokenize(line_buffer, argv);
+				if (overflow){
+					debugf("Line too long");
+					accepted = false;
+				} else if (argc == 0){ //empty or comment line
+					continue;
+				} else if (argc > CONFIG_MAX_TOKENS){
+					debugf("Too many arguments");
+					accepted = false;
+				} else if (strcmp(argv[0], "include") == 0){
+					accepted = argc == 2 && depth+1 < CONFIG_MAX_INCLUDE_DEPTH && strlen(argv[1]) < CONFIG_PATH_SIZE;
+					if (accepted){
+						depth++;
+						strcpy(files[depth].path, argv[1]);
+						files[depth].offset = 0;
+						files[depth].line_number = 0;
+						include = true;
+						break; //current is reopened at its offset when the include ends
+					}
+					debugf("Wrong include or includes nested too deep");
+				} else {
+					accepted = config_parse_line(argc, argv);
+				}
+				overflow = false;
+
+				if (accepted == false){
+					debugf("%s:%ld rejected", current->path, current->line_number);
+					rejected_lines++;
+				}
 			}
 		}
-		config_parse_line(argc, argv);
+		f_close(config_file_handle);
+
+		if (include){
+			continue;
+		}
+		if (depth == 0){
+			break;
+		}
+		depth--;
 	}
+
+	debugf("Config loaded, %ld lines rejected", rejected_lines);
+	return true;
 }
 
-static void config_parse_line(uint32_t argc, char *argv[]){
-	//each config line has the following format:
-	//TYPE PID_MODE PID SAMPLING_INTERVAL
+//splits the line by spaces and tabs in place, a token starting with # comments out the rest
+//of the line, returns the number of tokens (CONFIG_MAX_TOKENS+1 if there are too many)
+static uint32_t config_tokenize(char *line, char *argv[]){
+	uint32_t argc = 0;
+	while (1){
+		while (*line == ' ' || *line == '\t'){
+			*line++ = '\0';
+		}
+		if (*line == '\0' || *line == '#'){
+			break;
+		}
+		if (argc == CONFIG_MAX_TOKENS){
+			return CONFIG_MAX_TOKENS+1;
+		}
+		argv[argc++] = line;
+		while (*line != '\0' && *line != ' ' && *line != '\t'){
+			line++;
+		}
+	}
+	argv[argc] = NULL;
+	return argc;
+}
+
+//Config lines have the following formats, arguments are separated by spaces or tabs
+//and # starts a comment. Intervals are parsed by config_parse_interval.
+//
+//Channel lines:
+//TYPE PID_MODE PID SAMPLING_INTERVAL [ADAPTIVE_MAX_INTERVAL] [OPTIONS]
+//If ADAPTIVE_MAX_INTERVAL is given the PID is sampled every SAMPLING_INTERVAL
+//when the value changes quickly and backs off up to ADAPTIVE_MAX_INTERVAL when it is flat.
+//"PID_MODE PID" can be replaced by a PID name from _config_pid_names, eg. "1 rpm 100ms".
+//A signal listed again in the same profile section is ignored (the first line wins).
+//OPTIONS of PID channels are key=value pairs after the arguments:
+//deadband=TOLERANCE keyframe=KEYFRAME_INTERVAL - same as a D line
+//aggregate=WINDOW - same as an A line
+//
+//Burst channel lines have the format:
+//B PID_MODE PID NORMAL_INTERVAL BURST_INTERVAL
+//The PID is sampled every BURST_INTERVAL but logged every NORMAL_INTERVAL
+//unless a trigger has fired.
+//
+//Aggregated channel lines have the format:
+//A PID_MODE PID SAMPLING_INTERVAL WINDOW
+//Instead of every sample one frame with min, max, mean and last value is logged per WINDOW.
+//
+//Change-only (deadband) channel lines have the format:
+//D PID_MODE PID SAMPLING_INTERVAL TOLERANCE KEYFRAME_INTERVAL
+//A sample is logged only if the raw PID value (byte A or bytes A and B) differs from
+//the last logged one by more than TOLERANCE or KEYFRAME_INTERVAL has elapsed.
+//
+//Trigger lines, see config_parse_trigger_line:
+//T PID_MODE PID OPERATOR THRESHOLD PRETRIGGER HOLD
+//
+//PID request budget line has the format:
+//Q REQUESTS_PER_SECOND
+//If all PID channels together request more, their intervals are stretched proportionally.
+//
+//GPS rate line has the format:
+//G RATE_HZ [BINARY]
+//RATE_HZ is 0 (one fix per 5 s, default) or 5 or 10, then every GPS epoch is logged.
+//BINARY 1 requests the MTK binary protocol, NMEA is used if the module does not support it.
+//
+//Dead reckoning line has the format:
+//P [GPS_ACCURACY_M]
+//A position frame is logged for every vehicle speed sample (mode 01 PID 0D), the position
+//is moved along the last GPS course and corrected by GPS fixes.
+//
+//GPS power policy line has the format:
+//S STANDBY_AFTER_MINUTES [PERIODIC]
+//The GPS goes to standby (PERIODIC 1 - periodic standby) when vehicle speed is zero and
+//RPM is idle for STANDBY_AFTER_MINUTES, and wakes up when the vehicle moves.
+//Speed (01 0D) and/or RPM (01 0C) must be sampled at least once a minute, otherwise the GPS
+//stays on (or is woken up when the samples stop).
+//
+//Profile line has the format:
+//F PROFILE
+//Channel lines after it are sampled only while PROFILE is active (0 - always).
+//Profile 1 is active outside of all geofences.
+//
+//Geofence lines have the format:
+//FC PROFILE LAT LON RADIUS_M     (circle)
+//FP PROFILE                      (polygon, followed by its vertices)
+//FV LAT LON                      (polygon vertex)
+//LAT and LON are in decimal degrees. When the vehicle is inside a fence its PROFILE
+//becomes active, the first matching fence in the file wins.
+//
+//Log rotation line has the format:
+//R SEGMENT_MB [SEGMENT_MINUTES]
+//The log is continued in a new file when the current one reaches SEGMENT_MB megabytes
+//or SEGMENT_MINUTES minutes (0 - no limit). Segments are DAYHOURMINUTESECOND.001, .002, ...
+//
+//Free space line has the format:
+//K RESERVE_MB
+//The oldest logs are deleted when less than RESERVE_MB megabytes are free (default 32).
+//
+//Include line has the format:
+//include PATH
+//Lines of PATH (eg. obdlog/can.txt) are loaded as if they were in place of the include line.
+
+#define CONFIG_PID_SELECTOR 0x01 //PID_MODE PID follows the command, can be given as a PID name
+#define CONFIG_CHANNEL_OPTIONS 0x02 //key=value options are allowed after the arguments
+
+typedef struct {
+	const char *name; //NULL - channel line starting with a numeric TYPE
+	uint8_t min_args; //including the command, options are not counted
+	uint8_t max_args;
+	uint8_t flags;
+	bool (*parse)(uint32_t argc, char *argv[]); //options follow the arguments, argv ends with NULL
+} config_command_t;
+
+static const config_command_t _config_commands[] = {
+		{ NULL, 4, 5, CONFIG_PID_SELECTOR | CONFIG_CHANNEL_OPTIONS, config_parse_channel_line },
+		{ "B", 5, 5, CONFIG_PID_SELECTOR | CONFIG_CHANNEL_OPTIONS, config_parse_channel_line },
+		{ "A", 5, 5, CONFIG_PID_SELECTOR | CONFIG_CHANNEL_OPTIONS, config_parse_channel_line },
+		{ "D", 6, 6, CONFIG_PID_SELECTOR | CONFIG_CHANNEL_OPTIONS, config_parse_channel_line },
+		{ "T", 7, 7, CONFIG_PID_SELECTOR, config_parse_trigger_line },
+		{ "Q", 2, 2, 0, config_parse_budget_line },
+		{ "G", 2, 3, 0, config_parse_gps_line },
+		{ "P", 1, 2, 0, config_parse_gps_line },
+		{ "S", 2, 3, 0, config_parse_gps_line },
+		{ "F", 2, 2, 0, config_parse_geofence_line },
+		{ "FC", 5, 5, 0, config_parse_geofence_line },
+		{ "FP", 2, 2, 0, config_parse_geofence_line },
+		{ "FV", 3, 3, 0, config_parse_geofence_line },
+		{ "R", 2, 3, 0, config_parse_storage_line },
+		{ "K", 2, 2, 0, config_parse_storage_line },
+};
 
-	if (argc != 4){
+typedef struct {
+	const char *name;
+	pid_mode_t pid_mode;
+	uint8_t pid;
+} config_pid_name_t;
+
+static const config_pid_name_t _config_pid_names[] = {
+		{ "status", pid_mode_01, 0x01 },
+		{ "load", pid_mode_01, 0x04 },
+		{ "coolant", pid_mode_01, 0x05 },
+		{ "map", pid_mode_01, 0x0B },
+		{ "rpm", pid_mode_01, 0x0C },
+		{ "speed", pid_mode_01, 0x0D },
+		{ "timing", pid_mode_01, 0x0E },
+		{ "iat", pid_mode_01, 0x0F },
+		{ "maf", pid_mode_01, 0x10 },
+		{ "throttle", pid_mode_01, 0x11 },
+		{ "runtime", pid_mode_01, 0x1F },
+		{ "fuel", pid_mode_01, 0x2F },
+		{ "baro", pid_mode_01, 0x33 },
+		{ "voltage", pid_mode_01, 0x42 },
+		{ "ambient", pid_mode_01, 0x46 },
+		{ "oil", pid_mode_01, 0x5C },
+};
+
+static bool config_parse_line(uint32_t argc, char *argv[]){
+	const config_command_t *command = NULL;
+	for (uint32_t i = 0; i < sizeof(_config_commands)/sizeof(_config_commands[0]); i++){
+		const char *name = _config_commands[i].name;
+		if (name ? strcmp(argv[0], name) == 0 : (argv[0][0] >= '0' && argv[0][0] <= '9')){
+			command = &_config_commands[i];
+			break;
+		}
+	}
+	if (command == NULL){
+		debugf("Unknown config line %s", argv[0]);
+		return false;
+	}
+
+	//key=value options must follow the arguments
+	uint32_t option_count = 0;
+	for (uint32_t i = 1; i < argc; i++){
+		if (strchr(argv[i], '=')){
+			option_count++;
+		} else if (option_count){
+			debugf("Argument %s after options", argv[i]);
+			return false;
+		}
+	}
+	if (option_count && (command->flags & CONFIG_CHANNEL_OPTIONS) == 0){
+		debugf("Line %s takes no options", argv[0]);
+		return false;
+	}
+	argc -= option_count;
+
+	//a PID name is expanded to PID_MODE PID, the texts have to live until the line is parsed
+	char pid_mode_text[4];
+	char pid_text[4];
+	if ((command->flags & CONFIG_PID_SELECTOR) && argc > 1 && argv[1][0] >= 'a' && argv[1][0] <= 'z'){
+		const config_pid_name_t *pid_name = NULL;
+		for (uint32_t i = 0; i < sizeof(_config_pid_names)/sizeof(_config_pid_names[0]); i++){
+			if (strcmp(argv[1], _config_pid_names[i].name) == 0){
+				pid_name = &_config_pid_names[i];
+				break;
+			}
+		}
+		if (pid_name == NULL){
+			debugf("Unknown PID name %s", argv[1]);
+			return false;
+		}
+		memmove(&argv[2], &argv[1], (argc + option_count) * sizeof(char*)); //including the NULL
+		snprintf(pid_mode_text, sizeof(pid_mode_text), "%d", pid_name->pid_mode);
+		snprintf(pid_text, sizeof(pid_text), "%d", pid_name->pid);
+		argv[1] = pid_mode_text;
+		argv[2] = pid_text;
+		argc++;
+	}
+
+	if (argc < command->min_args || argc > command->max_args){
 		debugf("Wrong number of options in line? %ld", argc);
+		return false;
 	}
+	return command->parse(argc, argv);
+}
+
+static bool config_parse_channel_line(uint32_t argc, char *argv[]){
+	bool burst = argv[0][0] == 'B';
+	bool aggregate = argv[0][0] == 'A';
+	bool deadband = argv[0][0] == 'D';
 
 	acquisition_channel_t channel;
+	memset(&channel, 0, sizeof(acquisition_channel_t));
+	uint32_t value;
 
-	channel.channel_type = atoi(argv[0]);
+	if (burst || aggregate || deadband){
+		channel.channel_type = logger_frame_pid;
+	} else if (config_parse_number(argv[0], UINT8_MAX, &value)){
+		channel.channel_type = value;
+	} else {
+		return false;
+	}
 	if (channel.channel_type != logger_frame_pid &&
 			channel.channel_type != logger_frame_gps &&
 			channel.channel_type != logger_frame_acceleration &&
 			channel.channel_type != logger_frame_internal_diagnostics){
 		debugf("Wrong channel type! %d", channel.channel_type);
-		return;
+		return false;
 	}
 
-	if (channel.channel_type == logger_frame_pid){
-		channel.pid_mode = atoi(argv[1]);
-		if (channel.pid_mode != pid_mode_01 &&
-				channel.pid_mode != pid_mode_02 &&
-				channel.pid_mode != pid_mode_03 &&
-				channel.pid_mode != pid_mode_04 &&
-				channel.pid_mode != pid_mode_05&&
-				channel.pid_mode != pid_mode_09){
-			debugf("Wrong PID mode! %d", channel.pid_mode);
+	if (config_parse_number(argv[1], UINT8_MAX, &value) == false){
+		return false;
+	}
+	channel.pid_mode = value;
+	if (channel.channel_type == logger_frame_pid && config_pid_mode_valid(channel.pid_mode) == false){
+		return false;
+	}
+	if (config_parse_number(argv[2], UINT8_MAX, &value) == false){
+		return false;
+	}
+	channel.pid = value;
+	if (config_parse_interval(argv[3], &channel.interval) == false){
+		return false;
+	}
+
+	TickType_t second_interval = 0; //adaptive maximum, burst interval or aggregation window
+	uint32_t tolerance = 0;
+	TickType_t keyframe_interval = 0;
+	if (deadband){
+		if (config_parse_number(argv[4], UINT16_MAX, &tolerance) == false ||
+				config_parse_interval(argv[5], &keyframe_interval) == false){
+			return false;
 		}
+	} else if (argc == 5 && config_parse_interval(argv[4], &second_interval) == false){
+		return false;
 	}
+	TickType_t aggregation_window = aggregate ? second_interval : 0;
 
-	channel.pid = atoi(argv[2]);
+	for (char **option = &argv[argc]; *option; option++){
+		if (channel.channel_type != logger_frame_pid){
+			debugf("Options are only allowed for PID channels");
+			return false;
+		}
+		char *option_value = strchr(*option, '=');
+		*option_value++ = '\0';
+		bool valid;
+		if (strcmp(*option, "deadband") == 0){
+			valid = config_parse_number(option_value, UINT16_MAX, &tolerance);
+			deadband = true;
+		} else if (strcmp(*option, "keyframe") == 0){
+			valid = config_parse_interval(option_value, &keyframe_interval);
+		} else if (strcmp(*option, "aggregate") == 0){
+			valid = config_parse_interval(option_value, &aggregation_window) && aggregation_window;
+			aggregate = true;
+		} else {
+			debugf("Unknown option %s", *option);
+			valid = false;
+		}
+		if (valid == false){
+			return false;
+		}
+	}
+	if (aggregate && aggregation_window == 0){
+		debugf("Aggregation window can't be zero");
+		return false;
+	}
+	if (deadband && aggregate){ //aggregated samples never reach the deadband filter
+		debugf("Deadband and aggregation can't be combined");
+		return false;
+	}
+	if (keyframe_interval && deadband == false){
+		debugf("Keyframe without deadband");
+		return false;
+	}
 
-	uint32_t sampling_interval_seconds = atoi(argv[3]);
-	if (sampling_interval_seconds < 1){
-		debugf("Interval is smaller that 1 second (is %ld)", sampling_interval_seconds);
+	bool added;
+	if (burst){
+		TickType_t interval_normal = channel.interval;
+		channel.interval = second_interval;
+		added = acquisition_add_burst_channel(&channel, interval_normal);
+	} else if (argc == 5 && argv[0][0] != 'A'){
+		added = acquisition_add_adaptive_channel(&channel, second_interval);
+	} else {
+		added = acquisition_add_channel(&channel);
+	}
+	if (added == false){ //options of an ignored duplicate are not applied either
+		return false;
 	}
 
-	channel.interval = pdMS_TO_TICKS(sampling_interval_seconds * 1000);
-	channel.next_sample_timestamp = 0;
+	if (deadband){
+		log_deadband_configure(channel.pid_mode, channel.pid, tolerance, keyframe_interval);
+	} else if (aggregate){
+		log_aggregate_configure(channel.pid_mode, channel.pid, aggregation_window);
+	}
+	return true;
+}
+
+static bool config_parse_budget_line(uint32_t argc __attribute__((unused)), char *argv[]){
+	uint32_t requests_per_second;
+	if (config_parse_number(argv[1], 1000, &requests_per_second) == false){
+		return false;
+	}
+	acquisition_set_request_budget(requests_per_second);
+	return true;
+}
+
+static bool config_parse_gps_line(uint32_t argc, char *argv[]){
+	uint32_t value = 0;
+	uint32_t flag = 0;
+	if ((argc > 1 && config_parse_number(argv[1], UINT16_MAX, &value) == false) ||
+			(argc > 2 && config_parse_number(argv[2], 1, &flag) == false)){
+		return false;
+	}
+
+	switch (argv[0][0]){
+	case 'G':
+		if (value != 0 && value != 5 && value != 10){
+			debugf("Unsupported GPS rate %ld Hz", value);
+			return false;
+		}
+		gps_uart_set_update_rate(value);
+		gps_uart_request_binary(flag);
+		break;
+	case 'P':
+		dead_reckoning_enable(value);
+		break;
+	case 'S':
+		gps_uart_set_power_policy(value, flag);
+		break;
+	}
+	return true;
+}
+
+static bool config_parse_storage_line(uint32_t argc, char *argv[]){
+	uint32_t value;
+	if (argv[0][0] == 'K'){
+		if (config_parse_number(argv[1], UINT16_MAX, &value) == false){
+			return false;
+		}
+		log_space_set_reserve(value);
+		return true;
+	}
+
+	uint32_t minutes = 0;
+	if (config_parse_number(argv[1], 4095, &value) == false ||
+			(argc > 2 && config_parse_number(argv[2], 10080, &minutes) == false)){
+		return false;
+	}
+	_segment_max_bytes = value << 20;
+	_segment_max_ticks = pdMS_TO_TICKS(60000) * (TickType_t)minutes;
+	return true;
+}
+
+static bool config_parse_geofence_line(uint32_t argc __attribute__((unused)), char *argv[]){
+	uint32_t profile = 0;
+	if (argv[0][1] != 'V' && config_parse_number(argv[1], UINT8_MAX, &profile) == false){
+		return false;
+	}
+
+	switch (argv[0][1]){
+	case '\0':
+		acquisition_begin_profile(profile);
+		return true;
+	case 'C': {
+		int32_t latitude;
+		int32_t longitude;
+		uint32_t radius_m;
+		if (config_parse_degrees(argv[2], &latitude) == false ||
+				config_parse_degrees(argv[3], &longitude) == false ||
+				config_parse_number(argv[4], UINT32_MAX, &radius_m) == false){
+			return false;
+		}
+		return geofence_add_circle(profile, latitude, longitude, radius_m);
+	}
+	case 'P':
+		return geofence_add_polygon(profile);
+	default: { //'V'
+		int32_t latitude;
+		int32_t longitude;
+		if (config_parse_degrees(argv[1], &latitude) == false ||
+				config_parse_degrees(argv[2], &longitude) == false){
+			return false;
+		}
+		return geofence_add_vertex(latitude, longitude);
+	}
+	}
+}
+
+//parses decimal degrees ("-12.3456789") to 1e-7 degrees without floating point,
+//anything but digits with an optional sign and fraction and values beyond 180 degrees are rejected
+static bool config_parse_degrees(const char *text, int32_t *degrees_e7){
+	const char *start = text;
+	bool negative = false;
+	if (*text == '-'){
+		negative = true;
+		text++;
+	}
+	int32_t value = 0;
+	uint32_t digits = 0;
+	while (*text >= '0' && *text <= '9' && value <= 180){
+		value = value * 10 + (*text - '0');
+		text++;
+		digits++;
+	}
+	bool in_range = value <= 180; //1e-7 degrees fit in int32
+	int32_t fraction_scale = 10000000;
+	if (*text == '.'){
+		text++;
+		while (*text >= '0' && *text <= '9'){
+			if (fraction_scale > 1){ //digits below 1e-7 degrees are ignored
+				fraction_scale /= 10;
+				value = value * 10 + (*text - '0');
+			}
+			text++;
+			digits++;
+		}
+	}
+	if (digits == 0 || *text != '\0' || in_range == false){
+		debugf("Wrong degrees %s", start);
+		return false;
+	}
+	value *= fraction_scale;
+	*degrees_e7 = negative ? -value : value;
+	return true;
+}
+
+static bool config_parse_trigger_line(uint32_t argc __attribute__((unused)), char *argv[]){
+	//trigger lines have the following format:
+	//T PID_MODE PID OPERATOR THRESHOLD PRETRIGGER HOLD
+	//OPERATOR is one of: > (above), < (below), c (changed), r (change per second above)
+	//THRESHOLD is a raw PID value (byte A or bytes A and B), eg. "T 1 12 > 20000 2 10"
+	//(or "T rpm > 20000 2 10") starts a burst when RPM exceeds 5000, logs 2 seconds before
+	//and holds the burst for 10 seconds.
+	//The samples before the trigger of all burst channels share one ring of 64 samples
+	//(PRETRIGGER_BUFFER_LENGTH), a longer PRETRIGGER is shortened with a warning at start,
+	//eg. two burst channels at 100ms hold 3.2 seconds.
+
+	uint32_t pid_mode;
+	uint32_t pid;
+	uint32_t threshold;
+	TickType_t pretrigger;
+	TickType_t hold;
+	if (config_parse_number(argv[1], UINT8_MAX, &pid_mode) == false ||
+			config_pid_mode_valid(pid_mode) == false ||
+			config_parse_number(argv[2], UINT8_MAX, &pid) == false ||
+			config_parse_number(argv[4], UINT16_MAX, &threshold) == false ||
+			config_parse_interval(argv[5], &pretrigger) == false ||
+			config_parse_interval(argv[6], &hold) == false){
+		return false;
+	}
+
+	trigger_operator_t op = argv[3][0];
+	if (argv[3][1] != '\0' ||
+			(op != trigger_above && op != trigger_below && op != trigger_changed && op != trigger_rate)){
+		debugf("Wrong trigger operator %s", argv[3]);
+		return false;
+	}
+
+	log_pretrigger_window_extend(pretrigger);
+	acquisition_add_trigger(pid_mode, pid, op, threshold, hold);
+	return true;
+}
+
+static bool config_pid_mode_valid(uint32_t pid_mode){
+	if (pid_mode != pid_mode_01 &&
+			pid_mode != pid_mode_02 &&
+			pid_mode != pid_mode_03 &&
+			pid_mode != pid_mode_04 &&
+			pid_mode != pid_mode_05 &&
+			pid_mode != pid_mode_09){
+		debugf("Wrong PID mode! %ld", pid_mode);
+		return false;
+	}
+	return true;
+}
+
+//parses a decimal number, trailing characters and values above max are rejected
+static bool config_parse_number(const char *text, uint32_t max, uint32_t *value){
+	char *end;
+	*value = strtoul(text, &end, 10);
+	if (end == text || *end != '\0' || *text == '-' || *value > max){
+		debugf("Wrong number %s", text);
+		return false;
+	}
+	return true;
+}
+
+static bool config_parse_interval(const char *text, TickType_t *interval){
+	//Intervals are in seconds by default, "ms" and "Hz" suffixes are also accepted,
+	//eg. "5" (5 seconds), "100ms", "20Hz". Zero means "sample once".
+	char *suffix;
+	uint32_t value = strtoul(text, &suffix, 10);
+	uint32_t interval_ms;
+	if (suffix == text || *text == '-'){
+		interval_ms = UINT32_MAX; //rejected below
+	} else if (suffix[0] == 'm' && suffix[1] == 's' && suffix[2] == '\0'){
+		interval_ms = value;
+	} else if ((suffix[0] == 'H' || suffix[0] == 'h') && (suffix[1] == 'z' || suffix[1] == 'Z') && suffix[2] == '\0'){
+		interval_ms = value > 1000 ? UINT32_MAX : value ? 1000 / value : 0;
+	} else if (suffix[0] == '\0' && value <= CONFIG_MAX_INTERVAL_MS / 1000){
+		interval_ms = value * 1000;
+	} else {
+		interval_ms = UINT32_MAX;
+	}
+	if (interval_ms > CONFIG_MAX_INTERVAL_MS){
+		debugf("Wrong interval %s", text);
+		return false;
+	}
+
+	*interval = pdMS_TO_TICKS(interval_ms);
+	if (interval_ms && *interval == 0){
+		debugf("Interval %ldms is shorter than one tick", interval_ms);
+		*interval = 1;
+	}
+	return true;
+}
+
+/* All file writes of the storage task are scheduled here. Debug lines are written in
+ * batches of STORAGE_IO_DEBUG_BATCH bytes (or after STORAGE_IO_DEBUG_MAX_DELAY), log
+ * data in whole sectors (see log_frame). Periodic syncs are ordered so that metadata
+ * of one file is updated while its sectors are still in the FatFS window.
+ */
+#define STORAGE_IO_DEBUG_BATCH 256
+#define STORAGE_IO_DEBUG_MAX_DELAY pdMS_TO_TICKS(1000)
+
+static void storage_io_debug_subtask(void){
+	static TickType_t last_write = 0;
+	uint16_t pending = debug_file_pending();
+	if (pending >= STORAGE_IO_DEBUG_BATCH || (pending && xTaskGetTickCount() - last_write >= STORAGE_IO_DEBUG_MAX_DELAY)){
+		debug_file_task();
+		last_write = xTaskGetTickCount();
+	}
+}
+
+static void storage_io_sync(void){
+	debug_file_task(); //may allocate clusters, before the FAT is touched below
+	storage_sync(); //log data, FAT and directory entry
+	powerfail_reserve(&_file_handle); //same FAT and directory sectors
+	log_space_task();
+	debug_sync();
+	trip_summary_sync(); //last - borrows the clean window and invalidates it
+}
 
-	acquisition_add_channel(&channel);
+void storage_io_report(void){
+	//write amplification - card traffic per payload byte since the last report
+	static uint32_t last_payload = 0;
+	static disk_stats_t last;
+	disk_stats_t now;
+	disk_get_stats(&now);
+	uint32_t log_bytes = log_get_bytes_written();
+	uint32_t debug_bytes = debug_file_get_bytes_written();
+	uint32_t payload = log_bytes + debug_bytes - last_payload;
+	uint32_t written = now.sectors_written - last.sectors_written;
+	debugf("io: log %ld B, debug %ld B, wrote %ld sectors in %ld commands, read %ld sectors, amplification %ld%%",
+			log_bytes,
+			debug_bytes,
+			written,
+			now.write_commands - last.write_commands,
+			now.sectors_read - last.sectors_read,
+			payload ? written * 512 * 100 / payload : 0); //fits for any SPI transfer rate
+	last_payload = log_bytes + debug_bytes;
+	last = now;
 }
 
 void storage_sync(void){
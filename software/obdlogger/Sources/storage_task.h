@@ -4,5 +4,6 @@
 void storage_task(void *params);
 
 void storage_sync(void);
+void storage_io_report(void); //logs write amplification since the last report
 
 #endif /* SOURCES_STORAGE_TASK_H_ */
@@ -0,0 +1,139 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <FreeRTOS/include/FreeRTOS.h>
+#include "timebase.h"
+#include <string.h>
+
+#define DEBUG_ID DEBUG_ID_GPS_CORE
+#include <debug.h>
+
+/* Running model mapping RTOS ticks to UTC.
+ *
+ * Every valid GPS epoch gives a (tick, UTC) pair. The tick rate error is measured
+ * against an anchor pair at least TIMEBASE_MIN_SPAN_s old, so the jitter of the
+ * epoch timestamps (arrival of the first byte) averages out. Conversion uses the
+ * most recent pair and the measured drift.
+ *
+ * All times are kept in sub-ticks (1/256 of a tick) and microseconds.
+ */
+
+#define US_PER_TICK (1000000 / configTICK_RATE_HZ)
+#define TIMEBASE_MIN_SPAN_s 10 //shorter spans give a too noisy drift estimate
+#define TIMEBASE_MAX_SPAN_s 3600 //re-anchor to follow temperature changes of the crystal
+#define TIMEBASE_MAX_ERROR_us 100000 //larger prediction error means GPS time jumped - restart the model
+
+typedef struct {
+	TickType_t ticks;
+	uint8_t fraction;
+	uint64_t utc_us;
+} sync_point_t;
+
+static bool _valid;
+static bool _drift_valid;
+static int32_t _drift_ppb;
+static sync_point_t _anchor;
+static sync_point_t _last;
+
+static const uint16_t DAYS_BEFORE_MONTH[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+static int64_t elapsed_subticks(const sync_point_t *from, TickType_t ticks, uint8_t fraction);
+static int64_t subticks_to_us(int64_t subticks);
+static uint64_t utc_to_us(const struct minmea_date *date, const struct minmea_time *time);
+
+void timebase_update(TickType_t ticks, uint8_t fraction, const struct minmea_date *date, const struct minmea_time *time){
+	if (date->month < 1 || date->month > 12){
+		return; //no date yet
+	}
+
+	sync_point_t point = { .ticks = ticks, .fraction = fraction, .utc_us = utc_to_us(date, time) };
+
+	if (_valid){
+		int64_t predicted_us = _last.utc_us + subticks_to_us(elapsed_subticks(&_last, ticks, fraction));
+		int64_t error_us = (int64_t)point.utc_us - predicted_us;
+		if (error_us > TIMEBASE_MAX_ERROR_us || error_us < -TIMEBASE_MAX_ERROR_us){
+			debugf("timebase error %ld us - restarting", (int32_t)error_us);
+			_valid = false;
+		}
+	}
+
+	if (_valid == false){
+		_anchor = point;
+		_last = point;
+		_drift_ppb = 0;
+		_drift_valid = false;
+		_valid = true;
+		return;
+	}
+
+	_last = point;
+
+	int64_t measured_us = point.utc_us - _anchor.utc_us;
+	if (measured_us >= TIMEBASE_MIN_SPAN_s * 1000000LL){
+		int64_t nominal_us = elapsed_subticks(&_anchor, ticks, fraction) * US_PER_TICK / 256;
+		_drift_ppb = ((nominal_us - measured_us) * 1000000000LL) / measured_us;
+		_drift_valid = true;
+	}
+	if (measured_us >= TIMEBASE_MAX_SPAN_s * 1000000LL){
+		_anchor = point;
+	}
+}
+
+bool timebase_ticks_to_utc(TickType_t ticks, uint8_t fraction, uint32_t *utc_seconds, uint32_t *utc_microseconds){
+	if (_valid == false){
+		return false;
+	}
+	uint64_t utc_us = _last.utc_us + subticks_to_us(elapsed_subticks(&_last, ticks, fraction));
+	*utc_seconds = utc_us / 1000000;
+	*utc_microseconds = utc_us % 1000000;
+	return true;
+}
+
+void timebase_fill_sync_frame(frame_time_sync_t *frame){
+	memset(frame, 0, sizeof(frame_time_sync_t));
+	frame->frame_type = logger_frame_time_sync;
+	frame->timestamp = _last.ticks;
+	frame->timestamp_fraction = _last.fraction;
+	frame->flags = _drift_valid ? TIME_SYNC_FLAG_DRIFT_VALID : 0;
+	frame->utc_seconds = _last.utc_us / 1000000;
+	frame->utc_microseconds = _last.utc_us % 1000000;
+	frame->drift_ppb = _drift_ppb;
+}
+
+static int64_t elapsed_subticks(const sync_point_t *from, TickType_t ticks, uint8_t fraction){
+	//signed, so ticks before the sync point work too; unsigned difference handles wrap-around
+	int32_t elapsed_ticks = (int32_t)(ticks - from->ticks);
+	return (int64_t)elapsed_ticks * 256 + fraction - from->fraction;
+}
+
+static int64_t subticks_to_us(int64_t subticks){
+	int64_t nominal_us = subticks * US_PER_TICK / 256;
+	return nominal_us - (nominal_us * _drift_ppb) / 1000000000LL;
+}
+
+static uint64_t utc_to_us(const struct minmea_date *date, const struct minmea_time *time){
+	uint32_t year = 2000 + date->year;
+	uint32_t days = (year - 1970) * 365 + (year - 1969) / 4; //leap days since 1970, valid until 2100
+	days += DAYS_BEFORE_MONTH[date->month - 1];
+	if (date->month > 2 && (year % 4) == 0){
+		days++;
+	}
+	days += date->day - 1;
+
+	uint32_t seconds = days * 86400 + time->hours * 3600 + time->minutes * 60 + time->seconds;
+	return (uint64_t)seconds * 1000000 + time->microseconds;
+}
@@ -0,0 +1,18 @@
+#ifndef SOURCES_TIMEBASE_H_
+#define SOURCES_TIMEBASE_H_
+#include <FreeRTOS/include/FreeRTOS.h>
+#include "logger_frames.h"
+#include "minmea.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+//feeds a valid GPS epoch into the tick to UTC model
+void timebase_update(TickType_t ticks, uint8_t fraction, const struct minmea_date *date, const struct minmea_time *time);
+
+//returns false until the first valid GPS epoch
+bool timebase_ticks_to_utc(TickType_t ticks, uint8_t fraction, uint32_t *utc_seconds, uint32_t *utc_microseconds);
+
+//fills the frame with the most recent sync point
+void timebase_fill_sync_frame(frame_time_sync_t *frame);
+
+#endif /* SOURCES_TIMEBASE_H_ */
@@ -0,0 +1,50 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <FreeRTOS/include/FreeRTOS.h>
+#include <FreeRTOS/include/task.h>
+#include <MKE06Z4.h>
+#include "timestamp.h"
+
+/* The RTOS tick (configTICK_RATE_HZ) is generated by SysTick, which counts
+ * down from LOAD to 0 during every tick period. The elapsed part of the current
+ * period is used as a sub-tick fraction, so no extra timer is needed.
+ */
+
+static void timestamp_read(TickType_t t, TickType_t *ticks, uint8_t *fraction){
+	uint32_t load = SysTick->LOAD;
+	uint32_t value = SysTick->VAL;
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk){ //counter wrapped, tick interrupt is pending
+		t++;
+		value = SysTick->VAL; //re-read, value from before the wrap is not valid
+	}
+
+	*ticks = t;
+	*fraction = ((load - value) << 8) / (load + 1);
+}
+
+void timestamp_get(TickType_t *ticks, uint8_t *fraction){
+	taskENTER_CRITICAL();
+	timestamp_read(xTaskGetTickCount(), ticks, fraction);
+	taskEXIT_CRITICAL();
+}
+
+void timestamp_get_from_isr(TickType_t *ticks, uint8_t *fraction){
+	UBaseType_t mask = portSET_INTERRUPT_MASK_FROM_ISR();
+	timestamp_read(xTaskGetTickCountFromISR(), ticks, fraction);
+	portCLEAR_INTERRUPT_MASK_FROM_ISR(mask);
+}
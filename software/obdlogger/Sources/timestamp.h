@@ -0,0 +1,10 @@
+#ifndef SOURCES_TIMESTAMP_H_
+#define SOURCES_TIMESTAMP_H_
+#include <FreeRTOS/include/FreeRTOS.h>
+#include <stdint.h>
+
+//returns RTOS tick count and elapsed fraction of the current tick in 1/256 units
+void timestamp_get(TickType_t *ticks, uint8_t *fraction);
+void timestamp_get_from_isr(TickType_t *ticks, uint8_t *fraction);
+
+#endif /* SOURCES_TIMESTAMP_H_ */
@@ -0,0 +1,198 @@
+/*
+Open OBD2 datalogger
+Copyright (C) 2018 Artur Langner
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <FreeRTOS/include/FreeRTOS.h>
+#include <FreeRTOS/include/task.h>
+#include <FatFS/diskio.h>
+#include "file_paths.h"
+#include <misc.h>
+#include <obd/obd_pids.h>
+#include <string.h>
+#include "timebase.h"
+#include "trip_summary.h"
+
+#define DEBUG_ID DEBUG_ID_STORAGE_TASK
+#include <debug.h>
+
+/* Running statistics of the trip (one boot), kept in one record of TRIP_INDEX_PATH,
+ * so trips can be filtered on the host without downloading their logs.
+ *
+ * The record slot is appended at boot while a file handle is free. Later the
+ * record is written straight to its sector through the borrowed FatFS window,
+ * like the power fail record, so no second FIL is needed. Two records share a
+ * sector, the other half is read back first.
+ */
+
+#define SECTOR_SIZE 512
+#define MAX_SPEED_GAP_TICKS pdMS_TO_TICKS(10000) //distance is not extrapolated over longer gaps
+#define SPEED_PID 0x0D
+#define MONITOR_STATUS_PID 0x01
+
+static FATFS *_fs;
+static DWORD _record_sector; //0 = index file is not available
+static uint16_t _record_offset; //in the sector
+static trip_summary_t _trip;
+static uint64_t _speed_kmh_ticks; //vehicle speed integrated over time
+static uint64_t _gps_speed_mm_s_ticks;
+static TickType_t _last_speed_timestamp;
+static TickType_t _last_gps_timestamp;
+
+static void pid_statistics(const frame_pid_t *frame, uint16_t value);
+static void record_write(void);
+
+void trip_summary_init(FATFS *fs, FIL *scratch){
+	_fs = fs;
+
+	FRESULT r = f_open(scratch, TRIP_INDEX_PATH, FA_OPEN_ALWAYS | FA_WRITE);
+	if (r != FR_OK){
+		debugf("trip index open %d", r);
+		return;
+	}
+
+	//append an empty record, a partial one left by a damaged file is overwritten
+	FSIZE_t offset = f_size(scratch) & ~(FSIZE_t)(sizeof(trip_summary_t) - 1);
+	UINT bytes_written = 0;
+	f_lseek(scratch, offset);
+	f_write(scratch, &_trip, sizeof(_trip), &bytes_written);
+	r = f_sync(scratch);
+	if (r == FR_OK && bytes_written == sizeof(_trip)){
+		f_lseek(scratch, offset + 1); //inside the record, so clust points to its cluster
+		FSIZE_t cluster_offset = offset & ((FSIZE_t)fs->csize * SECTOR_SIZE - 1);
+		_record_sector = fs->database + (scratch->clust - 2) * fs->csize + cluster_offset / SECTOR_SIZE;
+		_record_offset = offset % SECTOR_SIZE;
+	}
+	f_close(scratch);
+	debugf("trip record %ld sector %ld", (uint32_t)(offset / sizeof(trip_summary_t)), _record_sector);
+
+	_trip.magic = TRIP_SUMMARY_MAGIC;
+}
+
+void trip_summary_pid(const frame_pid_t *frame){
+	if (frame->frame_type != logger_frame_pid && frame->frame_type != logger_frame_pretrigger_pid){
+		return;
+	}
+
+	//same raw value as used by triggers - byte A or bytes A and B
+	uint16_t value = frame->a;
+	if (obd_pid_get_length(frame->mode, frame->pid) != 1){
+		value = frame->a << 8 | frame->b;
+	}
+	pid_statistics(frame, value);
+
+	if (frame->mode != pid_mode_01){
+		return;
+	}
+	if (frame->pid == SPEED_PID){
+		TickType_t elapsed = frame->timestamp - _last_speed_timestamp;
+		if (_last_speed_timestamp && elapsed < MAX_SPEED_GAP_TICKS){
+			_speed_kmh_ticks += (uint32_t)frame->a * elapsed;
+		}
+		_last_speed_timestamp = frame->timestamp;
+	} else if (frame->pid == MONITOR_STATUS_PID){
+		if (frame->a & 0x80){
+			_trip.flags |= TRIP_SUMMARY_FLAG_MIL;
+		}
+		if ((frame->a & 0x7F) > _trip.dtc_max){
+			_trip.dtc_max = frame->a & 0x7F;
+		}
+	}
+}
+
+void trip_summary_gps(const gps_fix_t *gps){
+	uint32_t utc_seconds, utc_microseconds;
+	if (timebase_ticks_to_utc(gps->timestamp, gps->timestamp_fraction, &utc_seconds, &utc_microseconds)){
+		if (_trip.start_utc == 0){
+			_trip.start_utc = utc_seconds;
+		}
+		_trip.end_utc = utc_seconds;
+	}
+
+	TickType_t elapsed = gps->timestamp - _last_gps_timestamp;
+	if (_last_gps_timestamp && elapsed < MAX_SPEED_GAP_TICKS){
+		_gps_speed_mm_s_ticks += (uint64_t)gps->speed_mm_s * elapsed;
+	}
+	_last_gps_timestamp = gps->timestamp;
+}
+
+void trip_summary_frames(uint32_t frames_saved){
+	_trip.frame_count += frames_saved;
+}
+
+void trip_summary_sync(void){
+	_trip.duration_s = xTaskGetTickCount() / configTICK_RATE_HZ;
+	if (_speed_kmh_ticks){
+		//km/h * ticks -> m: 1000 / 3600 / configTICK_RATE_HZ
+		_trip.distance_m = _speed_kmh_ticks * 5 / (18 * configTICK_RATE_HZ);
+		_trip.flags &= ~TRIP_SUMMARY_FLAG_GPS_DISTANCE;
+	} else if (_gps_speed_mm_s_ticks){
+		_trip.distance_m = _gps_speed_mm_s_ticks / (1000 * configTICK_RATE_HZ);
+		_trip.flags |= TRIP_SUMMARY_FLAG_GPS_DISTANCE;
+	}
+	record_write();
+}
+
+void trip_summary_close(void){
+	_trip.flags |= TRIP_SUMMARY_FLAG_CLOSED;
+	trip_summary_sync();
+}
+
+static void pid_statistics(const frame_pid_t *frame, uint16_t value){
+	trip_pid_summary_t *s = NULL;
+	for (uint32_t i = 0; i < _trip.pid_count; i++){
+		if (_trip.pids[i].mode == frame->mode && _trip.pids[i].pid == frame->pid){
+			s = &_trip.pids[i];
+			break;
+		}
+	}
+	if (s == NULL){
+		if (_trip.pid_count >= TRIP_SUMMARY_MAX_PIDS){
+			return; //table full, later PIDs are not summarized
+		}
+		s = &_trip.pids[_trip.pid_count];
+		_trip.pid_count++;
+		s->mode = frame->mode;
+		s->pid = frame->pid;
+		s->min = value;
+		s->max = value;
+	}
+
+	if (value < s->min){
+		s->min = value;
+	}
+	if (value > s->max){
+		s->max = value;
+	}
+	if (unlikely(s->sum + value < s->sum)){
+		return; //sum would overflow, the mean covers the samples so far
+	}
+	s->sum += value;
+	s->count++;
+}
+
+static void record_write(void){
+	//the FatFS window is the only free sector buffer, it can be borrowed when it is clean
+	if (_record_sector == 0 || _fs->wflag){
+		return;
+	}
+	_fs->winsect = 0xFFFFFFFF; //window no longer holds any sector, FatFS reloads it
+	if (disk_read(_fs->drv, _fs->win, _record_sector, 1) != RES_OK){
+		return;
+	}
+	memcpy(_fs->win + _record_offset, &_trip, sizeof(_trip));
+	disk_write(_fs->drv, _fs->win, _record_sector, 1);
+	disk_ioctl(_fs->drv, CTRL_SYNC, 0);
+}
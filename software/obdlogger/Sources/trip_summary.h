@@ -0,0 +1,50 @@
+#ifndef SOURCES_TRIP_SUMMARY_H_
+#define SOURCES_TRIP_SUMMARY_H_
+#include <FatFS/ff.h>
+#include "gps_core.h"
+#include "logger_frames.h"
+#include <stdint.h>
+
+#define TRIP_SUMMARY_MAGIC 0x50495254 //"TRIP"
+#define TRIP_SUMMARY_MAX_PIDS 14
+#define TRIP_SUMMARY_FLAG_CLOSED 0x01 //the trip ended normally (low voltage shutdown)
+#define TRIP_SUMMARY_FLAG_MIL 0x02 //malfunction indicator lamp was on (mode 01 PID 01)
+#define TRIP_SUMMARY_FLAG_GPS_DISTANCE 0x04 //no vehicle speed samples, distance is from GPS speed
+
+//raw values as used by triggers - byte A or bytes A and B
+typedef struct {
+	uint8_t mode; //0 - unused slot
+	uint8_t pid;
+	uint16_t min;
+	uint16_t max;
+	uint16_t reserved1;
+	uint32_t sum; //mean = sum / count
+	uint32_t count;
+} trip_pid_summary_t;
+
+//one 256 byte little endian record of TRIP_INDEX_PATH per boot
+typedef struct {
+	uint32_t magic; //TRIP_SUMMARY_MAGIC, 0 if the trip was never synced
+	uint32_t start_utc; //Unix seconds of the first GPS epoch, 0 without GPS time
+	uint32_t end_utc; //Unix seconds of the last GPS epoch
+	uint32_t duration_s; //since boot
+	uint32_t distance_m;
+	uint32_t frame_count; //PID frames written to the log
+	uint8_t flags;
+	uint8_t dtc_max; //highest number of confirmed DTCs reported by mode 01 PID 01
+	uint8_t pid_count;
+	uint8_t reserved1;
+	uint32_t reserved2;
+	trip_pid_summary_t pids[TRIP_SUMMARY_MAX_PIDS]; //first PIDs seen in the trip
+} trip_summary_t;
+_Static_assert(sizeof(trip_summary_t) == 256, "Wrong size?");
+
+//Functions to be called only from the storage task
+void trip_summary_init(FATFS *fs, FIL *scratch); //before the log file is opened, scratch is used temporarily
+void trip_summary_pid(const frame_pid_t *frame); //every PID sample, including ones not logged
+void trip_summary_gps(const gps_fix_t *gps); //called with every valid fix
+void trip_summary_frames(uint32_t frames_saved);
+void trip_summary_sync(void); //writes the record, call after the log file is synced
+void trip_summary_close(void);
+
+#endif /* SOURCES_TRIP_SUMMARY_H_ */